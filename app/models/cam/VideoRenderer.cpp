@@ -378,22 +378,22 @@ void VideoRenderer::AddResultsForTraining(QString path, QString tagName, QString
             std::cout << "AddResultsForTraining Error: Directory does not exist or is not a directory." << std::endl;
             return;
         }
-        std::ofstream fr_csv(std::getenv("CVL_MODELS_ROOT") +
-            std::string("FaceRecognition/fr.csv"), std::ios::app);
-        if (!fr_csv) {
-            std::cout << "Error opening frsv for writing." << std::endl;
-            return;
-        }
+        // enrolled into the running index and appended to fr.csv
+        auto recognizer = cvl::make_face_recognizer();
         std::string sep1 = "/";
-        std::string sep2 = ";";
+        size_t added = 0;
         for (const auto& entry : fs::directory_iterator(p)) {
             if (fs::is_regular_file(entry.path())) {
-                //std::cout << entry.path().filename() << std::endl;
-                std::string line = entry.path().parent_path().string() + sep1 +
-                    entry.path().filename().string() + sep2 + tagId.toStdString() + sep2 + tagName.toStdString();
-                std::replace(line.begin(), line.end(), '\\', '/');
-                fr_csv << line << '\n';
+                std::string file = entry.path().parent_path().string() + sep1 +
+                    entry.path().filename().string();
+                std::replace(file.begin(), file.end(), '\\', '/');
+                if (recognizer->add(file, tagId.toInt(), tagName.toStdString())) {
+                    added++;
+                }
             }
         }
+        if (added) {
+            recognizer->save();
+        }
     }
 }
\ No newline at end of file
@@ -54,7 +54,8 @@ QVariant FsModel::data(const QModelIndex &index, int role) const {
             return IsElementDirectory(row);
         }
         case EFileSize: {
-            return QString::fromStdString(m_model[row].m_size);
+            return IsElementDirectory(row) ? QString() :
+                QString::number(m_model[row].m_size);
         }
         case EFileIsSelected: {
           return m_model[row].m_selected;
@@ -85,8 +86,7 @@ bool FsModel::IsElementDirectory(int index) const {
 }
 
 uint64_t FsModel::GetElementSize(int index) const {
-    return IsElementDirectory(index) ? 0 :
-        std::stoll(m_model[index].m_size);
+    return IsElementDirectory(index) ? 0 : m_model[index].m_size;
 }
 
 QString FsModel::getCurrentDirectory(void) {
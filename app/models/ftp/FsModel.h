@@ -7,8 +7,8 @@
 
 struct FileElement {
     osl::string m_name;
-    std::string m_size;
-    std::string m_timestamp;
+    uint64_t m_size = 0;
+    int64_t m_timestamp = 0;
     std::string m_attributes;
     bool m_selected = false;
 };
@@ -2,6 +2,7 @@
 #include <LocalFsModel.h>
 #include <RemoteFsModel.h>
 
+#include <chrono>
 #include <filesystem>
 
 void LocalFsModel::QueueTransfers(bool start) {
@@ -99,7 +100,7 @@ void LocalFsModel::setCurrentDirectory(QString directory) {
     beginResetModel();
     m_model.clear();
     m_fileCount = m_folderCount = 0;
-    m_model.push_back({"..", "", "", "d"});
+    m_model.push_back({"..", 0, 0, "d"});
     std::error_code ec;
     for (std::filesystem::directory_iterator entryIt(m_currentDirectory.utf8(), ec);
             !ec && entryIt != std::filesystem::end(entryIt); entryIt.increment(ec)) {
@@ -112,15 +113,21 @@ void LocalFsModel::setCurrentDirectory(QString directory) {
         auto u8name = entry.path().filename().u8string();
         std::string name(reinterpret_cast<const char*>(u8name.data()), u8name.size());
         // get file size safely
-        std::string sizeStr = "0";
+        uint64_t size = 0;
         if (!isDir) {
             std::uintmax_t fsize = entry.file_size(ec);
-            if (!ec) sizeStr = std::to_string(fsize);
+            if (!ec) size = fsize;
+        }
+        int64_t timestamp = 0;
+        auto ftime = entry.last_write_time(ec);
+        if (!ec) {
+            timestamp = std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::file_clock::to_sys(ftime).time_since_epoch()).count();
         }
         m_model.push_back({
             osl::string(name),
-            sizeStr,
-            "",
+            size,
+            timestamp,
             (isDir ? "d" : "-"),
             false
         });
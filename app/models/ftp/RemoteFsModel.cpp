@@ -2,6 +2,34 @@
 #include <LocalFsModel.h>
 #include <RemoteFsModel.h>
 
+// collapses repeated separators and drops a trailing one, "//a/b/" -> "/a/b"
+static std::string NormalizePath(const std::string& path) {
+    std::string normalized;
+    for (auto c : path) {
+        if (c == '/' && !normalized.empty() && normalized.back() == '/') continue;
+        normalized += c;
+    }
+    if (normalized.size() > 1 && normalized.back() == '/') {
+        normalized.pop_back();
+    }
+    return normalized.empty() ? "/" : normalized;
+}
+
+static std::string ParentPath(const std::string& path) {
+    auto pos = path.rfind('/');
+    return (pos == std::string::npos || pos == 0) ? "/" : path.substr(0, pos);
+}
+
+static FileElement ToFileElement(const npl::list_entry& e) {
+    return {
+        osl::string(std::string(e.name)),
+        e.size,
+        e.timestamp,
+        std::string(e.attributes),
+        false
+    };
+}
+
 bool RemoteFsModel::Connect(QString host, QString port, QString user, QString password, QString protocol) {
     m_port = port.toInt();
     m_host = host.toStdString();
@@ -13,8 +41,10 @@ bool RemoteFsModel::Connect(QString host, QString port, QString user, QString pa
         m_ftp->set_idle_callback([this](){
             QMetaObject::invokeMethod(this, [=, this](){
                 for (auto rit = m_directories_to_remove.rbegin();
-                    rit != m_directories_to_remove.rend(); rit++)
-                m_ftp->removeDirectory(*rit);
+                    rit != m_directories_to_remove.rend(); rit++) {
+                    m_ftp->removeDirectory(*rit);
+                    InvalidateListing(*rit, true);
+                }
                 if (!m_directories_to_remove.empty()) {
                     m_directories_to_remove.clear();
                     RefreshRemoteView();
@@ -44,6 +74,7 @@ bool RemoteFsModel::Connect(QString host, QString port, QString user, QString pa
                             beginResetModel();
                             m_model.clear();
                             endResetModel();
+                            m_listings.clear();
                         }
                     }, Qt::QueuedConnection);
             }});
@@ -89,7 +120,7 @@ void RemoteFsModel::DownloadInternal(const std::string& file, const std::string&
                     localPath + path_sep + fe.m_name,
                     remotePath + "/" + fe.m_name,
                     npl::ftp::download,
-                    'I', std::stoull(fe.m_size)
+                    'I', fe.m_size
                 });
             }
         });
@@ -104,14 +135,18 @@ void RemoteFsModel::DownloadInternal(const std::string& file, const std::string&
 }
 
 void RemoteFsModel::WalkRemoteDirectory(const std::string& path, TFileElementListCallback callback) {
+    auto fe_list = std::make_shared<std::vector<FileElement>>();
+    auto parser = std::make_shared<npl::list_parser>(GetListFormat(),
+        [fe_list](const npl::list_entry& e) {
+            fe_list->push_back(ToFileElement(e));
+        });
     m_ftp->Transfer(npl::ftp::list, path,
-        [=, list = std::string(), this] (const char *b, size_t n) mutable {
+        [=] (const char *b, size_t n) {
             if (b) {
-                list.append(b, n);
+                parser->feed(b, n);
             } else {
-                std::vector<FileElement> fe_list;
-                ParseDirectoryList(list, fe_list);
-                callback(fe_list);
+                parser->finish();
+                callback(*fe_list);
             }
             return true;
         }, {}, m_protection);
@@ -119,6 +154,7 @@ void RemoteFsModel::WalkRemoteDirectory(const std::string& path, TFileElementLis
 
 void RemoteFsModel::RemoveFile(QString path) {
     m_ftp->removeFile(path.toStdString());
+    InvalidateListing(path.toStdString());
 }
 
 void RemoteFsModel::RemoveDirectory(QString path) {
@@ -139,6 +175,7 @@ void RemoteFsModel::RemoveDirectory(QString path) {
             if (fe_list.empty() || onlyFiles) {
                 m_ftp->removeDirectory(path.toStdString(),
                     {[](const std::string& res) { STATUS(1) << res; }});
+                InvalidateListing(path.toStdString(), true);
                 RefreshRemoteView();
             } else {
                 m_directories_to_remove.push_back(path.toStdString());
@@ -149,6 +186,7 @@ void RemoteFsModel::RemoveDirectory(QString path) {
 void RemoteFsModel::CreateDirectory(QString path) {
     m_ftp->createDirectory(path.toStdString(),
         {[](const std::string& res) { STATUS(1) << res; }});
+    InvalidateListing(path.toStdString());
     RefreshRemoteView();
 }
 
@@ -158,6 +196,8 @@ void RemoteFsModel::Rename(QString from, QString to) {
             if (res[0] == '4' || res[0] == '5')
                 STATUS(1) << "Error: " << res;
         }});
+    InvalidateListing(from.toStdString(), true);
+    InvalidateListing(to.toStdString(), true);
     RefreshRemoteView();
 }
 
@@ -179,32 +219,59 @@ void RemoteFsModel::setConnected(bool isConnected) {
 }
 
 void RemoteFsModel::setCurrentDirectory(QString directory) {
-    m_ftp->setCurrentDirectory(directory.toStdString());
-    m_ftp->Transfer(npl::ftp::list, directory.toStdString(),
-        [=, list = std::string(), this] (const char *b, size_t n) mutable {
-            if (!b) {
-                std::vector<FileElement> fe_list;
-                if (directory.toStdString() != "/") {
-                    fe_list.push_back({"..", "", "", "d"});
-                }
-                int fileCount = 0, folderCount = 0;
-                ParseDirectoryList(list, fe_list, &fileCount, &folderCount);
-                m_fileCount = fileCount, m_folderCount = folderCount;
-                std::ranges::partition(fe_list, [](const auto& e) {
-                    return e.m_attributes[0] == 'd';
-                });
-                QMetaObject::invokeMethod(this, [=, this](){
-                    beginResetModel();
-                    m_model.clear();
-                    m_model = fe_list;
-                    endResetModel();
-                    m_currentDirectory = directory.toStdString();
-                    emit directoryList();
-                    STATUS(1) << "Directory listing successful";
-                }, Qt::QueuedConnection);
+    auto path = NormalizePath(directory.toStdString());
+    // a newer listing supersedes any batches still queued for this one
+    auto listing = ++m_listing;
+    CachedListing cached;
+    auto lookup = m_listings.get(ListingKey(path), cached);
+    m_ftp->setCurrentDirectory(path);
+    if (lookup == decltype(m_listings)::lookup::miss) {
+        ListDirectory(path, listing, false);
+        return;
+    }
+    ResetModel(path, cached.m_elements);
+    emit directoryList();
+    if (lookup == decltype(m_listings)::lookup::stale) {
+        RevalidateListing(path, cached.m_modify, listing);
+    }
+}
+
+void RemoteFsModel::ListDirectory(const std::string& path, uint64_t listing, bool background) {
+    auto key = ListingKey(path);
+    auto batch = std::make_shared<std::vector<FileElement>>();
+    auto parser = std::make_shared<npl::list_parser>(GetListFormat(),
+        [batch](const npl::list_entry& e) {
+            batch->push_back(ToFileElement(e));
+        });
+    auto post = [=, this](bool first, bool last) {
+        QMetaObject::invokeMethod(this, [=, this, fe_list = std::move(*batch)](){
+            if (listing != m_listing) return;
+            if (first) {
+                ResetModel(path, {});
+            }
+            AppendElements(fe_list);
+            if (last) {
+                auto dotdot = (path != "/") ? 1 : 0;
+                m_listings.put(key, {
+                    {m_model.begin() + dotdot, m_model.end()},
+                    parser->directory_timestamp()});
+                emit directoryList();
+                STATUS(1) << "Directory listing successful";
+            }
+        }, Qt::QueuedConnection);
+        batch->clear();
+    };
+    m_ftp->Transfer(npl::ftp::list, path,
+        [=, first = true] (const char *b, size_t n) mutable {
+            if (b) {
+                parser->feed(b, n);
+                // a background refresh replaces the served copy in one go
+                if (background || batch->empty()) return true;
             } else {
-                list.append(b, n);
+                parser->finish();
             }
+            post(first, !b);
+            first = false;
             return true;
         },
         {[this](const std::string& res) {
@@ -216,117 +283,99 @@ void RemoteFsModel::setCurrentDirectory(QString directory) {
         m_protection);
 }
 
-void RemoteFsModel::RefreshRemoteView(void) {
-    setCurrentDirectory(QString::fromStdString(m_currentDirectory));
-}
-
-void RemoteFsModel::ParseDirectoryList(const std::string& list, std::vector<FileElement>& fe_list, int *pfc, int *pdc) {
-    DBG << list;
-    if (m_ftp->hasFeature("MLSD"))
-        ParseMLSDList(list, fe_list, pfc, pdc);
-    else if (m_ftp->systemType().find("UNIX") != std::string::npos)
-        ParseLinuxList(list, fe_list, pfc, pdc);
-    else if (m_ftp->systemType().find("Windows") != std::string::npos)
-        ParseWindowsList(list, fe_list, pfc, pdc);
+// a stale listing is kept if the directory's MLST modify fact still matches
+// the one recorded with it, otherwise it is listed again
+void RemoteFsModel::RevalidateListing(const std::string& path, int64_t modify, uint64_t listing) {
+    if (!modify || !m_ftp->hasFeature("MLST")) {
+        ListDirectory(path, listing, true);
+        return;
+    }
+    m_ftp->getFileInfo(path,
+        {[=, this](const std::string& res) {
+            int64_t current = 0;
+            if (res[0] == '2') {
+                for (auto& line : osl::split<std::string>(res, "\r\n")) {
+                    if (!line.empty() && line[0] == ' ') {
+                        npl::list_entry e;
+                        npl::list_parser::parse_mlsd(line.substr(1), e, &current);
+                        current = current ? current : e.timestamp;
+                    }
+                }
+            }
+            QMetaObject::invokeMethod(this, [=, this](){
+                if (current == modify) {
+                    m_listings.touch(ListingKey(path));
+                } else if (listing == m_listing) {
+                    ListDirectory(path, listing, true);
+                } else {
+                    m_listings.erase(ListingKey(path));
+                }
+            }, Qt::QueuedConnection);
+        }});
 }
 
-// type=file;size=8192;modify=20221219022112.389;perms=awr; DumpStack.log
-// type=dir;modify=20221015170330.792;perms=cple; Intel
-void RemoteFsModel::ParseMLSDList(const std::string& list, std::vector<FileElement>& fe_list, int *pfc, int *pdc) {
-  auto lines = osl::split<std::string>(list, "\r\n");
-  for (auto& line : lines) {
-    if (line.empty()) continue;
-    std::string name;
-    auto pos = line.rfind(';');
-    if (pos != std::string::npos) {
-      pos++;
-      name = line.substr(pos);
-      name = osl::trim(name);
-    }
-    auto isDir = (line.find("type=dir") != std::string::npos);
-    std::string size;
-    if (!isDir) {
-      auto pos = line.find("size=");
-      if (pos != std::string::npos) {
-        pos += strlen("size=");
-        while (line[pos] != ';')
-          size += line[pos++];
-      }
+void RemoteFsModel::ResetModel(const std::string& path, const std::vector<FileElement>& fe_list) {
+    beginResetModel();
+    m_model.clear();
+    m_fileCount = m_folderCount = 0;
+    if (path != "/") {
+        m_model.push_back({"..", 0, 0, "d"});
     }
-    if (pfc && pdc) {
-      isDir ? (*pdc += 1) : (*pfc += 1);
+    for (const auto& fe : fe_list) {
+        fe.m_attributes[0] == 'd' ? m_folderCount++ : m_fileCount++;
     }
-    fe_list.push_back({
-        osl::string(name),
-        size,
-        "",
-        isDir ? "d" : "-",
-        false
-    });
-  }
+    m_model.insert(m_model.end(), fe_list.begin(), fe_list.end());
+    endResetModel();
+    m_currentDirectory = path;
 }
 
-// -rw-rw-rw- 1 ftp    ftp       1468320 Oct 15 17:37 a b c
-void RemoteFsModel::ParseLinuxList(const std::string& list, std::vector<FileElement>& fe_list, int *pfc, int *pdc) {
-    auto lines = osl::split<std::string>(list, "\r\n");
-    for (auto& line : lines) {
-        if (line.empty()) continue;
-        FileElement fe;
-        auto p = line.c_str();
-        fe.m_attributes.append(p, 10), p += 10;
-        auto isDir = (fe.m_attributes[0] == 'd');
-        for (int i = 0; i < 3; i++) {
-            while(*p == ' ') { p++; }
-            while(*p != ' ') { p++; }
-        }
-        while(*p == ' ') { p++; }
-        while(*p != ' ') {
-            fe.m_size.append(1, *p);
-            p++;
-        }
-        while(*p == ' ') { p++; }
-        int count = 0;
-        while(count != 3) {
-            fe.m_timestamp.append(1, *p);
-            p++;
-            if (*p == ' ') {
-                count++;
-                fe.m_timestamp.append(1, *p);
-                while(*p == ' ') { p++; }
-            }
-        }
-        while(*p == ' ') { p++; }
-        fe.m_name += p;
-        fe_list.push_back(fe);
-        if (pfc && pdc) isDir ? (*pdc += 1) : (*pfc += 1);
+// drops cached listings made stale by a mutation of path issued from here
+void RemoteFsModel::InvalidateListing(const std::string& path, bool recursive) {
+    auto normalized = NormalizePath(path);
+    m_listings.erase(ListingKey(ParentPath(normalized)));
+    if (recursive) {
+        auto key = ListingKey(normalized);
+        m_listings.erase_if([&](const std::string& k) {
+            return k == key || k.starts_with(key + "/");
+        });
     }
 }
 
-void RemoteFsModel::ParseWindowsList(const std::string& list, std::vector<FileElement>& fe_list, int *pfc, int *pdc) {
-    LOG << list;
-    auto lines = osl::split<std::string>(list, "\r\n");
-    for (auto& line : lines) {
-        if (line.empty()) continue;
-        auto p = line.c_str();
-        while(*p != ' ') { p++; }
-        while(*p == ' ') { p++; }
-        while(*p != ' ') { p++; }
-        while(*p == ' ') { p++; }
-        auto isDir = (0 == memcmp(p, "<DIR>", strlen("<DIR>")));
-        std::string size, name;
-        while(*p != ' ') {
-            size.append(1, *p);
-            p++;
-        }
-        while(*p == ' ') { p++; }
-        name.append(p);
-        if (pfc && pdc) isDir ? (*pdc += 1) : (*pfc += 1);
-        fe_list.push_back({
-            osl::string(name),
-            size,
-            "",
-            isDir ? "d" : "-",
-            false
-        });
+std::string RemoteFsModel::ListingKey(const std::string& path) {
+    return m_user + "@" + m_host + ":" + std::to_string(m_port) + path;
+}
+
+void RemoteFsModel::RefreshRemoteView(void) {
+    setCurrentDirectory(QString::fromStdString(m_currentDirectory));
+}
+
+npl::list_format RemoteFsModel::GetListFormat(void) {
+    if (m_ftp->hasFeature("MLSD"))
+        return npl::list_format::mlsd;
+    if (m_ftp->systemType().find("Windows") != std::string::npos)
+        return npl::list_format::list_windows;
+    return npl::list_format::list_unix;
+}
+
+// rows arrive in batches while the listing is still streaming in,
+// directories are inserted ahead of files to keep the view partitioned
+void RemoteFsModel::AppendElements(const std::vector<FileElement>& fe_list) {
+    std::vector<FileElement> dirs, files;
+    for (const auto& fe : fe_list) {
+        (fe.m_attributes[0] == 'd' ? dirs : files).push_back(fe);
+    }
+    if (!dirs.empty()) {
+        int row = m_model.size() - m_fileCount;
+        beginInsertRows(QModelIndex(), row, row + dirs.size() - 1);
+        m_model.insert(m_model.begin() + row, dirs.begin(), dirs.end());
+        m_folderCount += dirs.size();
+        endInsertRows();
+    }
+    if (!files.empty()) {
+        int row = m_model.size();
+        beginInsertRows(QModelIndex(), row, row + files.size() - 1);
+        m_model.insert(m_model.end(), files.begin(), files.end());
+        m_fileCount += files.size();
+        endInsertRows();
     }
 }
@@ -2,6 +2,7 @@
 #define REMOTEFSMODEL_H
 
 #include <npl/npl>
+#include <osl/cache>
 
 #include <FsModel.h>
 
@@ -9,6 +10,14 @@
 
 using TFileElementListCallback = std::function<void (const std::vector<FileElement>&)>;
 
+constexpr size_t LISTING_CACHE_ENTRIES = 64;
+constexpr auto LISTING_CACHE_TTL = std::chrono::seconds(30);
+
+struct CachedListing {
+    std::vector<FileElement> m_elements;
+    int64_t m_modify = 0;
+};
+
 class RemoteFsModel : public FsModel {
 
     Q_OBJECT
@@ -35,6 +44,8 @@ class RemoteFsModel : public FsModel {
     std::string m_protocol;
     npl::tls m_protection = npl::tls::yes;
 
+    void InvalidateListing(const std::string& path, bool recursive = false);
+
     signals:
 
     void connected(bool);
@@ -50,15 +61,20 @@ class RemoteFsModel : public FsModel {
 
     void RefreshRemoteView(void);
     void WalkRemoteDirectory(const std::string& path, TFileElementListCallback callback);
-    void ParseMLSDList(const std::string& list, std::vector<FileElement>& fe_list, int *pfc = nullptr, int * pdc = nullptr);
-    void ParseLinuxList(const std::string& list, std::vector<FileElement>& fe_list, int *pfc = nullptr, int *pdc = nullptr);
-    void ParseWindowsList(const std::string& list, std::vector<FileElement>& fe_list, int *pfc = nullptr, int *pdc = nullptr);
-    void ParseDirectoryList(const std::string& list, std::vector<FileElement>& fe_list, int *pfc = nullptr, int *pdc = nullptr);
+    npl::list_format GetListFormat(void);
+    std::string ListingKey(const std::string& path);
+    void ListDirectory(const std::string& path, uint64_t listing, bool background);
+    void RevalidateListing(const std::string& path, int64_t modify, uint64_t listing);
+    void ResetModel(const std::string& path, const std::vector<FileElement>& fe_list);
+    void AppendElements(const std::vector<FileElement>& fe_list);
     void DownloadInternal(const std::string& file, const std::string& folder, const std::string& localFolder, bool isFolder, uint64_t size = 0);
 
     bool m_connected = false;
+    uint64_t m_listing = 0;
     npl::spftp m_ftp;
     std::vector<std::string> m_directories_to_remove;
+    osl::lru_cache<std::string, CachedListing> m_listings{
+        LISTING_CACHE_ENTRIES, LISTING_CACHE_TTL};
 };
 
 #endif
\ No newline at end of file
@@ -204,6 +204,7 @@ void TransferManager::UploadTransfer(const Transfer& t, int sid) {
         if (!e.empty()) {
             directory += "/" + e;
             ftp->createDirectory(directory);
+            m_ftpModel->InvalidateListing(directory);
         }
     }
     auto file = npl::make_file(t.m_local, false);
@@ -233,6 +234,7 @@ void TransferManager::UploadTransfer(const Transfer& t, int sid) {
                 if (m_queue[i].m_state != Transfer::state::successful) {
                     QMetaObject::invokeMethod(this, [=, this](){
                         m_queue[i].m_state = Transfer::state::successful;
+                        m_ftpModel->InvalidateListing(m_queue[i].m_remote);
                         emit transferSuccessful(i, ++m_successful_transfers);
                     });
                 }
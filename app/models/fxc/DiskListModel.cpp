@@ -288,7 +288,7 @@ void DiskListModel::refreshModel() {
         } else {
             item->m_sourceIndex = item->m_sourceOptions.indexOf("live");
         }
-        item->m_formatOptions << "raw" << "d-vhdx";
+        item->m_formatOptions << "raw" << "d-vhdx" << "c-fxc";
         if (size < _2T) {
             item->m_formatOptions << "d-vhd" << "f-vhd";
             item->m_formatIndex = item->m_formatOptions.indexOf("d-vhd");
@@ -305,7 +305,7 @@ void DiskListModel::refreshModel() {
             auto c = std::make_shared<BlockDevice>(QVector<QString>(child), depth, 0, size, free);
             c->m_sourceOptions << "live";
             c->m_sourceIndex = c->m_sourceOptions.indexOf("live");
-            c->m_formatOptions << "raw" << "d-vhdx";
+            c->m_formatOptions << "raw" << "d-vhdx" << "c-fxc";
             if (size < _2T) {
                 c->m_formatOptions << "d-vhd" << "f-vhd";
                 c->m_formatIndex = c->m_formatOptions.indexOf("d-vhd");
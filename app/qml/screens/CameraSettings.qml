@@ -596,6 +596,14 @@ Item {
                     checked: vr.mocapAlgo === 4
                     onClicked: vr.mocapAlgo = 4
                 }
+                CheckBox {
+                    id: motionCascade
+                    checked: vr.flags & 16
+                    text: qsTr("Cascade")
+                    onCheckedChanged: {
+                        checked ? (vr.flags |= 16) : (vr.flags &= ~16)
+                    }
+                }
             }
             Row {
                 spacing: 4
@@ -0,0 +1,1931 @@
+#include <map>
+#include <cmath>
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+
+#include <npl/npl>
+#include <osl/cache>
+#include <fxc/vd/vd>
+#include <cvl/cvl>
+
+#include <opencv2/videoio.hpp>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+using namespace std::chrono;
+
+// synthetic listings in the three formats list_parser understands
+static std::string make_listing(npl::list_format format, size_t lines) {
+    std::string list;
+    list.reserve(lines * 72);
+    for (size_t i = 0; i < lines; i++) {
+        auto dir = (i % 8) == 0;
+        auto size = std::to_string(dir ? 4096 : (i * 7919) % 100000000);
+        auto name = (dir ? "folder_" : "file_") + std::to_string(i) + (dir ? "" : ".bin");
+        switch (format) {
+            case npl::list_format::mlsd:
+                list += dir ? "type=dir;" : "type=file;size=" + size + ";";
+                list += "modify=20221219022112.389;perms=awr; " + name + "\r\n";
+                break;
+            case npl::list_format::list_unix:
+                list += dir ? "drwxr-xr-x" : "-rw-rw-rw-";
+                list += " 1 ftp    ftp " + std::string(14 - size.size(), ' ') + size;
+                list += " Oct 15 " + std::string((i & 1) ? "17:37 " : " 2021 ") + name + "\r\n";
+                break;
+            case npl::list_format::list_windows:
+                list += "10-15-22  05:37PM ";
+                list += dir ? "      <DIR>         " : std::string(20 - size.size(), ' ') + size;
+                list += " " + name + "\r\n";
+                break;
+        }
+    }
+    return list;
+}
+
+// feeds the listing in data channel sized chunks, the way LIST data arrives
+static void bench_listing(size_t lines, size_t chunk) {
+    const char *names[] = { "mlsd", "unix", "windows" };
+    for (auto format : { npl::list_format::mlsd,
+                         npl::list_format::list_unix,
+                         npl::list_format::list_windows }) {
+        auto list = make_listing(format, lines);
+        uint64_t bytes = 0;
+        npl::list_parser parser(format, [&](const npl::list_entry& e) {
+            bytes += e.size;
+        });
+        auto start = steady_clock::now();
+        for (size_t off = 0; off < list.size(); off += chunk) {
+            parser.feed(list.data() + off, std::min(chunk, list.size() - off));
+        }
+        parser.finish();
+        auto secs = duration<double>(steady_clock::now() - start).count();
+        auto parsed = parser.file_count() + parser.folder_count();
+        std::cout << "{\"bench\":\"listing\",\"format\":\"" << names[(int)format]
+                  << "\",\"lines\":" << lines
+                  << ",\"parsed\":" << parsed
+                  << ",\"chunk\":" << chunk
+                  << ",\"seconds\":" << secs
+                  << ",\"lines_per_sec\":" << (uint64_t)(parsed / secs)
+                  << ",\"mb_per_sec\":" << (list.size() / secs) / _1M
+                  << ",\"checksum\":" << bytes << "}" << std::endl;
+    }
+}
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+// 1080p frames at a fixed rate through the pooled frame ring. measures
+// enqueue->dequeue latency and how often a frame's pixels get copied; the
+// consumer can simulate per frame work to force drop-oldest
+static void bench_frame_queue(int frames, int fps, int work_ms) {
+    cvl::queue<cv::Mat, 4> q;
+    cvl::mat_pool pool(12);
+    cv::Mat capture(1080, 1920, CV_8UC3, cv::Scalar(40, 80, 120));
+    std::vector<const uchar *> produced(frames, nullptr);
+    std::vector<double> latency;
+    uint64_t transfer_copies = 0;
+    std::atomic<bool> done{false};
+    std::thread consumer([&]() {
+        cv::Mat f;
+        while (!done || q.size()) {
+            if (!q.wait_dequeue(f, milliseconds(50))) continue;
+            int64_t stamp = 0;
+            int index = 0;
+            memcpy(&stamp, f.data, sizeof(stamp));
+            memcpy(&index, f.data + sizeof(stamp), sizeof(index));
+            auto now = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+            latency.push_back((now - stamp) / 1000.0);
+            if (f.data != produced[index]) transfer_copies++;
+            f.release();
+            if (work_ms) std::this_thread::sleep_for(milliseconds(work_ms));
+        }
+    });
+    auto next = steady_clock::now();
+    auto period = duration_cast<steady_clock::duration>(duration<double>(1.0 / fps));
+    for (int i = 0; i < frames; i++) {
+        auto dim = std::max(capture.cols, capture.rows);
+        auto f = pool.acquire(cv::Size(dim, dim), capture.type());
+        cvl::geometry::makeSquare(capture, f);
+        produced[i] = f.data;
+        int64_t stamp = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+        memcpy(f.data, &stamp, sizeof(stamp));
+        memcpy(f.data + sizeof(stamp), &i, sizeof(i));
+        q.enqueue(std::move(f));
+        next += period;
+        std::this_thread::sleep_until(next);
+    }
+    done = true;
+    consumer.join();
+    auto consumed = std::max<size_t>(latency.size(), 1);
+    std::cout << "{\"bench\":\"frame_queue\",\"frames\":" << frames
+              << ",\"fps\":" << fps
+              << ",\"work_ms\":" << work_ms
+              << ",\"consumed\":" << latency.size()
+              << ",\"dropped\":" << q.dropped()
+              << ",\"p50_us\":" << percentile(latency, 0.50)
+              << ",\"p99_us\":" << percentile(latency, 0.99)
+              << ",\"pool_allocations\":" << pool.allocations()
+              << ",\"pool_exhausted\":" << pool.exhausted()
+              // makeSquare is the only pixel copy unless the ring copies too
+              << ",\"copies_per_frame\":" << 1.0 + (double)transfer_copies / consumed
+              << "}" << std::endl;
+}
+
+static uint64_t peak_rss_kb(void) {
+    #ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return pmc.PeakWorkingSetSize / 1024;
+    #else
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    #ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+    #else
+    return ru.ru_maxrss;
+    #endif
+    #endif
+}
+
+static uint64_t current_rss_kb(void) {
+    #ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return pmc.WorkingSetSize / 1024;
+    #elif defined(__APPLE__)
+    return peak_rss_kb();
+    #else
+    uint64_t pages = 0, resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> pages >> resident;
+    return resident * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+    #endif
+}
+
+// counts the cv::Mat buffers allocated while installed as the default
+// allocator, the buffers themselves come from (and go back to) the stock one
+struct counting_allocator : public cv::MatAllocator {
+
+    counting_allocator() {
+        cv::Mat::setDefaultAllocator(this);
+    }
+
+    ~counting_allocator() {
+        cv::Mat::setDefaultAllocator(nullptr);
+    }
+
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+            cv::AccessFlag flags, cv::UMatUsageFlags usage) const override {
+        auto u = cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usage);
+        if (u && !data) {
+            count++;
+            bytes += u->size;
+        }
+        return u;
+    }
+
+    bool allocate(cv::UMatData *u, cv::AccessFlag flags, cv::UMatUsageFlags usage) const override {
+        return cv::Mat::getStdAllocator()->allocate(u, flags, usage);
+    }
+
+    void deallocate(cv::UMatData *u) const override {
+        cv::Mat::getStdAllocator()->deallocate(u);
+    }
+
+    mutable std::atomic<uint64_t> count{0};
+    mutable std::atomic<uint64_t> bytes{0};
+};
+
+// a recorded video, or deterministic generated frames with a few moving
+// shapes over a noisy background when source is "synthetic" (just the
+// background for "static")
+static cvl::TFrameSource make_replay_source(const std::string& source, int frames) {
+    if (source == "static") {
+        auto background = std::make_shared<cv::Mat>(1080, 1920, CV_8UC3);
+        cv::RNG rng(0x0ff5e7);
+        rng.fill(*background, cv::RNG::UNIFORM, 0, 48);
+        return [=, index = 0](cv::Mat& f) mutable {
+            if (index++ >= frames) return false;
+            cv::Mat noise(background->size(), CV_16SC3);
+            cv::randn(noise, 0, 2);
+            cv::add(*background, noise, f, cv::noArray(), CV_8UC3);
+            return true;
+        };
+    }
+    if (source == "synthetic") {
+        auto background = std::make_shared<cv::Mat>(1080, 1920, CV_8UC3);
+        cv::RNG rng(0x0ff5e7);
+        rng.fill(*background, cv::RNG::UNIFORM, 0, 48);
+        return [=, index = 0](cv::Mat& f) mutable {
+            if (index >= frames) return false;
+            background->copyTo(f);
+            for (int i = 0; i < 4; i++) {
+                auto x = (index * (7 + i * 3) + i * 400) % (f.cols - 200);
+                auto y = 200 + i * 180;
+                cv::rectangle(f, cv::Rect(x, y, 160, 120), cv::Scalar(60 * i, 200, 255 - 60 * i), cv::FILLED);
+            }
+            cv::circle(f, cv::Point(960 + (index % 400) - 200, 540), 90, cv::Scalar(220, 220, 220), cv::FILLED);
+            index++;
+            return true;
+        };
+    }
+    auto cap = std::make_shared<cv::VideoCapture>(source);
+    return [=, index = 0](cv::Mat& f) mutable {
+        return (index++ < frames) && cap->isOpened() && cap->read(f);
+    };
+}
+
+// one detector fed the replayed frames a batch at a time; batch 1 is the
+// single frame path (blobFromImage and a forward per frame)
+static void bench_batch(const std::string& source, int frames, const char *name, cvl::SSDDetector& detector, cvl::spcc cc) {
+    std::vector<cv::Mat> replay;
+    auto next = make_replay_source(source, frames);
+    cv::Mat f;
+    while (next(f)) {
+        replay.emplace_back();
+        cvl::geometry::makeSquare(f, replay.back());
+    }
+    if (replay.empty()) return;
+    double single = 0;
+    for (size_t batch : {1, 2, 4, 8, 16}) {
+        size_t detections = 0;
+        auto start = steady_clock::now();
+        for (size_t i = 0; i < replay.size(); i += batch) {
+            auto n = std::min(batch, replay.size() - i);
+            if (batch == 1) {
+                detections += detector.Detect(replay[i], cc).size();
+                continue;
+            }
+            std::vector<cv::Mat> frames(replay.begin() + i, replay.begin() + i + n);
+            std::vector<cvl::spcc> ccs(n, cc);
+            for (const auto& d : detector.DetectBatch(frames, ccs)) {
+                detections += d.size();
+            }
+        }
+        auto fps = replay.size() / duration<double>(steady_clock::now() - start).count();
+        if (batch == 1) single = fps;
+        std::cout << "{\"bench\":\"replay_batch\",\"source\":\"" << source
+                  << "\",\"stage\":\"" << name
+                  << "\",\"batch\":" << batch
+                  << ",\"frames\":" << replay.size()
+                  << ",\"detections\":" << detections
+                  << ",\"fps\":" << fps
+                  << ",\"speedup\":" << fps / single << "}" << std::endl;
+    }
+}
+
+// replays the same frames through camera (unthrottled, for fps and drops)
+// and then straight through pipeline::execute (for per frame latency), once
+// per stage mask. detector models come from CVL_MODELS_ROOT. the mat bytes
+// allocated per frame are counted over the camera run (capture, squaring
+// and pipeline) and over execute alone, after a warm up frame. execute is
+// profiled on every other frame to put a number on the profiler overhead
+static void bench_replay(const std::string& source, int frames, const std::string& only) {
+    if (!std::getenv("CVL_MODELS_ROOT")) {
+        std::cout << "{\"bench\":\"replay\",\"error\":\"CVL_MODELS_ROOT not set\"}" << std::endl;
+        return;
+    }
+    const std::pair<const char *, int> masks[] = {
+        { "face", 1 }, { "object", 2 }, { "motion", 4 }, { "facerec", 1 | 8 }, { "length", 16 }
+    };
+    for (const auto& [name, stages] : masks) {
+        if (!only.empty() && only != name) continue;
+        auto cam = std::make_unique<cvl::camera>();
+        cam->cc->_stages = stages;
+        cam->cc->_skipFrames = 1;
+        cam->cc->_waitKeyTimeout = 0;
+        auto start = steady_clock::now();
+        uint64_t camera_bytes = 0, execute_bytes = 0, execute_allocs = 0;
+        {
+            counting_allocator counter;
+            cam->start([](const cv::Mat&) {}, make_replay_source(source, frames));
+            while (!cam->finished()) {
+                std::this_thread::sleep_for(milliseconds(10));
+            }
+            camera_bytes = counter.bytes;
+        }
+        auto secs = duration<double>(steady_clock::now() - start).count();
+        auto stats = cam->stats();
+        cam->stop();
+        std::vector<double> latency;
+        // summed ms and frame count, without and with the profile
+        double profiled[2] = {}, unprofiled[2] = {};
+        {
+            cvl::pipeline pipeLine;
+            auto profile = cvl::profiler::shared().add("bench");
+            auto next = make_replay_source(source, frames);
+            cv::Mat f, square;
+            std::unique_ptr<counting_allocator> counter;
+            while (next(f)) {
+                cvl::geometry::makeSquare(f, square);
+                auto on = latency.size() % 2;
+                pipeLine.set_profile(on ? profile : nullptr);
+                auto t = steady_clock::now();
+                pipeLine.execute(square, cam->cc);
+                latency.push_back(duration<double, std::milli>(steady_clock::now() - t).count());
+                auto& sum = on ? profiled : unprofiled;
+                sum[0] += latency.back();
+                sum[1]++;
+                if (!counter) {
+                    counter = std::make_unique<counting_allocator>();
+                } else {
+                    execute_bytes = counter->bytes;
+                    execute_allocs = counter->count;
+                }
+            }
+        }
+        auto measured = std::max<size_t>(latency.size(), 2) - 1;
+        std::cout << "{\"bench\":\"replay\",\"source\":\"" << source
+                  << "\",\"stage\":\"" << name
+                  << "\",\"mask\":" << stages
+                  << ",\"captured\":" << stats.captured
+                  << ",\"processed\":" << stats.processed
+                  << ",\"fps\":" << stats.processed / secs
+                  << ",\"dropped_in\":" << stats.dropped_in
+                  << ",\"dropped_out\":" << stats.dropped_out
+                  << ",\"p50_ms\":" << percentile(latency, 0.50)
+                  << ",\"p99_ms\":" << percentile(latency, 0.99)
+                  << ",\"camera_alloc_kb_per_frame\":" << camera_bytes / 1024.0 / std::max<uint64_t>(stats.captured, 1)
+                  << ",\"execute_alloc_kb_per_frame\":" << execute_bytes / 1024.0 / measured
+                  << ",\"execute_allocs_per_frame\":" << (double)execute_allocs / measured
+                  << ",\"profiler_overhead_pct\":" << ((profiled[1] && unprofiled[0] > 0) ?
+                        100 * (profiled[0] / profiled[1] * unprofiled[1] / unprofiled[0] - 1) : 0)
+                  << ",\"peak_rss_kb\":" << peak_rss_kb() << "}" << std::endl;
+        if (stages == 1) {
+            cvl::FaceDetector detector;
+            bench_batch(source, frames, name, detector, cam->cc);
+        } else if (stages == 2) {
+            cvl::ObjectDetector detector("person");
+            bench_batch(source, frames, name, detector, cam->cc);
+        }
+    }
+}
+
+// each bgsegm algorithm at full resolution and downscaled to width over the
+// same squared frames: ms per frame of each, and how well the downscaled
+// boxes agree with the full resolution ones (f1 of the boxes matched at iou
+// 0.3, a frame where both find nothing agrees fully)
+static void bench_motion(const std::string& source, int frames, int width) {
+    std::vector<cv::Mat> replay;
+    auto next = make_replay_source(source, frames);
+    cv::Mat f;
+    while (next(f)) {
+        replay.emplace_back();
+        cvl::geometry::makeSquare(f, replay.back());
+    }
+    if (replay.empty()) return;
+    const char *names[] = {"mog", "cnt", "gmg", "gsoc", "lsbp"};
+    for (int algo = 0; algo < 5; algo++) {
+        std::vector<cvl::Detections> found[2];
+        double ms[2] = {};
+        for (int downscaled = 0; downscaled < 2; downscaled++) {
+            auto cc = std::make_shared<cvl::cam_config>();
+            cc->_mocapAlgo = algo;
+            cc->_mocapWidth = downscaled ? width : 0;
+            cc->_mocapExcludeArea = 2500;
+            cvl::BackgroundSubtractor subtractor;
+            auto start = steady_clock::now();
+            for (auto& frame : replay) {
+                found[downscaled].push_back(subtractor.Detect(frame, cc));
+            }
+            ms[downscaled] = duration<double, std::milli>(steady_clock::now() - start).count() / replay.size();
+        }
+        double agreement = 0;
+        size_t boxes[2] = {};
+        for (size_t i = 0; i < replay.size(); i++) {
+            const auto& full = found[0][i];
+            const auto& small = found[1][i];
+            boxes[0] += full.size();
+            boxes[1] += small.size();
+            if (full.empty() && small.empty()) {
+                agreement += 1;
+                continue;
+            }
+            std::vector<bool> used(small.size(), false);
+            size_t matched = 0;
+            for (const auto& a : full) {
+                for (size_t j = 0; j < small.size(); j++) {
+                    if (!used[j] && cvl::geometry::computeIOU(a, small[j]) >= 0.3) {
+                        used[j] = true;
+                        matched++;
+                        break;
+                    }
+                }
+            }
+            agreement += 2.0 * matched / (full.size() + small.size());
+        }
+        std::cout << "{\"bench\":\"motion\",\"source\":\"" << source
+                  << "\",\"algo\":\"" << names[algo]
+                  << "\",\"width\":" << width
+                  << ",\"frames\":" << replay.size()
+                  << ",\"full_ms\":" << ms[0]
+                  << ",\"downscaled_ms\":" << ms[1]
+                  << ",\"speedup\":" << (ms[1] > 0 ? ms[0] / ms[1] : 0)
+                  << ",\"full_boxes\":" << boxes[0]
+                  << ",\"downscaled_boxes\":" << boxes[1]
+                  << ",\"agreement\":" << agreement / replay.size() << "}" << std::endl;
+    }
+}
+
+// a marker drifting over a noisy 1080p frame for the given seconds per
+// mode: "legacy" builds the dictionary on every call as detectArucoMarker
+// did, "cached" keeps one MarkerDetector searching full frames, "roi" one
+// that searches full frames every 10th. rss is sampled a tenth of the way
+// in and at the end to show growth
+static void bench_markers(int seconds, const std::string& only) {
+    cv::Mat background(1080, 1920, CV_8UC3);
+    cv::RNG rng(0x0ff5e7);
+    rng.fill(background, cv::RNG::UNIFORM, 0, 160);
+    cv::Mat marker, bordered;
+    cv::aruco::generateImageMarker(cv::aruco::getPredefinedDictionary(cv::aruco::DICT_6X6_250), 23, 160, marker, 1);
+    cv::copyMakeBorder(marker, bordered, 24, 24, 24, 24, cv::BORDER_CONSTANT, cv::Scalar(255));
+    cv::cvtColor(bordered, bordered, cv::COLOR_GRAY2BGR);
+    for (const std::string mode : {"legacy", "cached", "roi"}) {
+        if (only != "all" && only != mode) continue;
+        cvl::MarkerDetector detector(mode == "roi" ? 10 : 1);
+        cv::Mat frame;
+        uint64_t frames = 0, found = 0, rss_start = 0;
+        auto start = steady_clock::now();
+        auto end = start + std::chrono::seconds(seconds);
+        while (steady_clock::now() < end) {
+            background.copyTo(frame);
+            auto span = frame.cols - bordered.cols;
+            auto x = (int)(frames * 3 % (2 * span));
+            x = x < span ? x : 2 * span - x;
+            auto y = 300 + (int)(120 * std::sin(frames / 50.0));
+            bordered.copyTo(frame(cv::Rect(x, y, bordered.cols, bordered.rows)));
+            if (mode == "legacy") {
+                std::vector<int> ids;
+                std::vector<std::vector<cv::Point2f>> corners;
+                auto dictionary = new cv::aruco::Dictionary();
+                *dictionary = cv::aruco::getPredefinedDictionary(cv::aruco::DICT_6X6_250);
+                cv::aruco::detectMarkers(frame, cv::Ptr<cv::aruco::Dictionary>(dictionary), corners, ids);
+                found += ids.size();
+            } else {
+                found += detector.detect(frame);
+            }
+            frames++;
+            if (!rss_start && steady_clock::now() - start > std::chrono::seconds(seconds) / 10) {
+                rss_start = current_rss_kb();
+            }
+        }
+        auto secs = duration<double>(steady_clock::now() - start).count();
+        auto rss_end = current_rss_kb();
+        std::cout << "{\"bench\":\"markers\",\"mode\":\"" << mode
+                  << "\",\"seconds\":" << secs
+                  << ",\"frames\":" << frames
+                  << ",\"detections_per_sec\":" << found / secs
+                  << ",\"frames_per_sec\":" << frames / secs
+                  << ",\"hit_rate\":" << (frames ? (double)found / frames : 0)
+                  << ",\"full_searches\":" << detector.fullSearches()
+                  << ",\"roi_searches\":" << detector.roiSearches()
+                  << ",\"rss_start_kb\":" << rss_start
+                  << ",\"rss_end_kb\":" << rss_end
+                  << ",\"rss_growth_kb\":" << (int64_t)(rss_end - rss_start) << "}" << std::endl;
+    }
+}
+
+// cpu time per frame of pipeline::execute with and without the motion gated
+// cascade. "static" and "synthetic" give a still and a busy scene
+static void bench_cascade(const std::string& source, int frames, int stages) {
+    if (!std::getenv("CVL_MODELS_ROOT")) {
+        std::cout << "{\"bench\":\"cascade\",\"error\":\"CVL_MODELS_ROOT not set\"}" << std::endl;
+        return;
+    }
+    for (auto cascade : {false, true}) {
+        auto cc = std::make_shared<cvl::cam_config>();
+        cc->_flags = cascade ? cvl::CASCADE_FLAG : 0;
+        cc->_stages = stages;
+        cc->_mocapAlgo = 3;
+        cc->_mocapWidth = 320;
+        cc->_bbIncrement = 0;
+        cc->_bbThickness = 1;
+        cc->_faceConfidence = 5;
+        cc->_objectConfidence = 5;
+        cc->_facerecConfidence = 50;
+        cc->_mocapExcludeArea = 2500;
+        cvl::pipeline pipeLine;
+        auto next = make_replay_source(source, frames);
+        cv::Mat f, square;
+        std::vector<double> latency;
+        auto cpu = std::clock();
+        auto start = steady_clock::now();
+        while (next(f)) {
+            cvl::geometry::makeSquare(f, square);
+            auto t = steady_clock::now();
+            pipeLine.execute(square, cc);
+            latency.push_back(duration<double, std::milli>(steady_clock::now() - t).count());
+        }
+        auto cpu_ms = 1000.0 * (std::clock() - cpu) / CLOCKS_PER_SEC;
+        auto secs = duration<double>(steady_clock::now() - start).count();
+        auto n = std::max<size_t>(latency.size(), 1);
+        std::cout << "{\"bench\":\"cascade\",\"source\":\"" << source
+                  << "\",\"mode\":\"" << (cascade ? "cascade" : "full_frame")
+                  << "\",\"mask\":" << stages
+                  << ",\"frames\":" << latency.size()
+                  << ",\"fps\":" << latency.size() / secs
+                  << ",\"cpu_ms_per_frame\":" << cpu_ms / n
+                  << ",\"p50_ms\":" << percentile(latency, 0.50)
+                  << ",\"p99_ms\":" << percentile(latency, 0.99) << "}" << std::endl;
+    }
+}
+
+// tracker manager fps with n objects in view. the objects are textured
+// squares drifting over the synthetic background; their true boxes stand
+// in for detections every interval frames
+static void bench_tracking(int frames, int interval, const std::string& type, int threads) {
+    const std::pair<const char *, cvl::tracker_type> types[] = {
+        { "auto", cvl::tracker_type::automatic }, { "csrt", cvl::tracker_type::csrt },
+        { "kcf", cvl::tracker_type::kcf }, { "mosse", cvl::tracker_type::mosse }
+    };
+    cv::Mat background(720, 1280, CV_8UC3), patch(64, 64, CV_8UC3);
+    cv::RNG rng(0x0ff5e7);
+    rng.fill(background, cv::RNG::UNIFORM, 0, 48);
+    rng.fill(patch, cv::RNG::UNIFORM, 64, 255);
+    if (threads > 0) {
+        cv::setNumThreads(threads);
+    }
+    for (const auto& [name, kind] : types) {
+        if (type != "all" && type != name) continue;
+        for (int objects : {1, 5, 10, 25, 50}) {
+            auto cc = std::make_shared<cvl::cam_config>();
+            cc->_detectInterval = interval;
+            cvl::tracker_policy policy;
+            if (kind != cvl::tracker_type::automatic) {
+                policy.small = policy.large = kind;
+            }
+            cvl::Tracker tracker(policy);
+            auto box = [&](int i, int index) {
+                auto x = (i * 211 + index * (2 + i % 3)) % (background.cols - patch.cols);
+                auto y = (i * 97 + index * (1 + i % 2)) % (background.rows - patch.rows);
+                return cv::Rect2d(x, y, patch.cols, patch.rows);
+            };
+            cv::Mat frame;
+            double update_ms = 0;
+            size_t alive = 0;
+            for (int index = 0; index < frames; index++) {
+                background.copyTo(frame);
+                cvl::Detections truth;
+                for (int i = 0; i < objects; i++) {
+                    truth.push_back(box(i, index));
+                    patch.copyTo(frame(static_cast<cv::Rect>(truth.back())));
+                }
+                auto t = steady_clock::now();
+                tracker.updateTrackingContexts(frame, cc);
+                if (tracker.detectionDue(cc)) {
+                    tracker.associate(truth, frame);
+                }
+                update_ms += duration<double, std::milli>(steady_clock::now() - t).count();
+                alive += tracker.GetTrackingContextCount();
+            }
+            std::cout << "{\"bench\":\"tracking\",\"tracker\":\"" << name
+                      << "\",\"objects\":" << objects
+                      << ",\"interval\":" << interval
+                      << ",\"threads\":" << cv::getNumThreads()
+                      << ",\"frames\":" << frames
+                      << ",\"fps\":" << frames / (update_ms / 1000)
+                      << ",\"mean_tracks\":" << (double)alive / frames << "}" << std::endl;
+        }
+    }
+}
+
+// a detection storm: producers submit cropped snapshots (cloned, as the
+// pipeline does) as fast as they can into one encoder pool writing to a
+// scratch folder. threads 1, batch 1 is close to the old single save thread
+static void bench_snapshots(int count, int producers, int threads, int capacity, int batch, int quality, const std::string& policy) {
+    auto folder = std::filesystem::temp_directory_path() / "cvl_bench_snapshots";
+    std::filesystem::remove_all(folder);
+    std::filesystem::create_directories(folder);
+    std::vector<cv::Mat> crops(16);
+    cv::RNG rng(0x0ff5e7);
+    for (auto& crop : crops) {
+        crop.create(192 + rng.uniform(0, 128), 192 + rng.uniform(0, 128), CV_8UC3);
+        rng.fill(crop, cv::RNG::NORMAL, 128, 40);
+        cv::GaussianBlur(crop, crop, cv::Size(5, 5), 0);
+    }
+    auto drop = (policy == "newest") ? cvl::drop_policy::drop_newest :
+        (policy == "block") ? cvl::drop_policy::block : cvl::drop_policy::drop_oldest;
+    auto start = steady_clock::now();
+    cvl::encoder_stats stats;
+    {
+        cvl::encoder_pool pool(threads, capacity, batch, quality, drop);
+        std::vector<std::thread> workers;
+        for (int p = 0; p < producers; p++) {
+            workers.emplace_back([&, p]() {
+                for (int i = p; i < count; i += producers) {
+                    pool.submit(crops[i % crops.size()].clone(),
+                        (folder / ("s" + std::to_string(i))).string());
+                }
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        pool.flush();
+        stats = pool.stats();
+    }
+    auto secs = duration<double>(steady_clock::now() - start).count();
+    std::filesystem::remove_all(folder);
+    std::cout << "{\"bench\":\"snapshots\",\"threads\":" << threads
+              << ",\"producers\":" << producers
+              << ",\"capacity\":" << capacity
+              << ",\"batch\":" << batch
+              << ",\"quality\":" << quality
+              << ",\"policy\":\"" << policy
+              << "\",\"submitted\":" << stats.submitted
+              << ",\"written\":" << stats.written
+              << ",\"dropped\":" << stats.dropped
+              << ",\"failed\":" << stats.failed
+              << ",\"snapshots_per_sec\":" << stats.written / secs
+              << ",\"mb\":" << stats.bytes / (1024.0 * 1024.0)
+              << ",\"peak_queued\":" << stats.peak_queued
+              << ",\"peak_rss_kb\":" << peak_rss_kb() << "}" << std::endl;
+}
+
+// face index at 100, 10k and 100k identities (up to max) of synthetic 128
+// float embeddings: a unit centre per identity, enrolled and queried as
+// noisy normalised samples of it. recall is against the exhaustive search,
+// accuracy is the right identity coming back
+static void bench_faceindex(size_t max, int dim, int ef, int queries) {
+    auto sample = [dim](const std::vector<float>& centre, std::mt19937& rng) {
+        std::normal_distribution<float> noise(0.0f, 0.3f / std::sqrt((float)dim));
+        std::vector<float> v(centre);
+        float n = 0;
+        for (auto& f : v) {
+            f += noise(rng);
+            n += f * f;
+        }
+        for (auto& f : v) {
+            f /= std::sqrt(n);
+        }
+        return v;
+    };
+    for (size_t identities : {(size_t)100, (size_t)10000, (size_t)100000}) {
+        if (identities > max) {
+            break;
+        }
+        std::mt19937 rng(0xface);
+        std::normal_distribution<float> normal;
+        std::vector<std::vector<float>> centres(identities, std::vector<float>(dim));
+        for (auto& c : centres) {
+            float n = 0;
+            for (auto& f : c) {
+                f = normal(rng);
+                n += f * f;
+            }
+            for (auto& f : c) {
+                f /= std::sqrt(n);
+            }
+        }
+        std::vector<std::vector<float>> enrolled;
+        for (const auto& c : centres) {
+            enrolled.push_back(sample(c, rng));
+        }
+        cvl::hnsw_index index(dim);
+        auto start = steady_clock::now();
+        for (size_t i = 0; i < identities; i++) {
+            index.add((int)i, enrolled[i].data());
+        }
+        auto enrol_us = duration<double, std::micro>(steady_clock::now() - start).count() / identities;
+        std::vector<double> latency, exact_latency;
+        int recalled = 0, correct = 0;
+        for (int q = 0; q < queries; q++) {
+            auto id = rng() % identities;
+            auto v = sample(centres[id], rng);
+            auto t = steady_clock::now();
+            auto found = index.search(v.data(), 1, ef);
+            latency.push_back(duration<double, std::micro>(steady_clock::now() - t).count());
+            t = steady_clock::now();
+            auto exact = index.search_exact(v.data(), 1);
+            exact_latency.push_back(duration<double, std::micro>(steady_clock::now() - t).count());
+            recalled += found.size() && found[0].second == exact[0].second;
+            correct += found.size() && found[0].second == (int)id;
+        }
+        auto path = std::filesystem::temp_directory_path() / "cvl_bench_faceindex";
+        start = steady_clock::now();
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            index.save(out);
+        }
+        auto save_ms = duration<double, std::milli>(steady_clock::now() - start).count();
+        start = steady_clock::now();
+        cvl::hnsw_index loaded;
+        {
+            std::ifstream in(path, std::ios::binary);
+            loaded.load(in);
+        }
+        auto load_ms = duration<double, std::milli>(steady_clock::now() - start).count();
+        auto bytes = std::filesystem::file_size(path);
+        std::filesystem::remove(path);
+        std::cout << "{\"bench\":\"faceindex\",\"identities\":" << identities
+                  << ",\"dim\":" << dim
+                  << ",\"ef\":" << ef
+                  << ",\"enrol_us\":" << enrol_us
+                  << ",\"query_p50_us\":" << percentile(latency, 0.5)
+                  << ",\"query_p99_us\":" << percentile(latency, 0.99)
+                  << ",\"exhaustive_p50_us\":" << percentile(exact_latency, 0.5)
+                  << ",\"recall\":" << (double)recalled / queries
+                  << ",\"accuracy\":" << (double)correct / queries
+                  << ",\"save_ms\":" << save_ms
+                  << ",\"load_ms\":" << load_ms
+                  << ",\"loaded\":" << loaded.size()
+                  << ",\"mb\":" << bytes / (1024.0 * 1024.0)
+                  << ",\"peak_rss_kb\":" << peak_rss_kb() << "}" << std::endl;
+    }
+}
+
+// n cameras replaying the same source, either each with its own process
+// thread and models (workers == 0) or all on one scheduler with that many
+// workers. run one configuration per process so peak rss is its own
+static void bench_multicam(int streams, int workers, const std::string& source, int frames, int stages, double fps, int batch) {
+    if (!std::getenv("CVL_MODELS_ROOT")) {
+        std::cout << "{\"bench\":\"multicam\",\"error\":\"CVL_MODELS_ROOT not set\"}" << std::endl;
+        return;
+    }
+    std::shared_ptr<cvl::scheduler> sched;
+    if (workers > 0) {
+        sched = std::make_shared<cvl::scheduler>(workers, cvl::schedule::round_robin, batch);
+    }
+    std::vector<std::unique_ptr<cvl::camera>> cams;
+    for (int i = 0; i < streams; i++) {
+        auto cam = std::make_unique<cvl::camera>();
+        cam->cc->_stages = stages;
+        cam->cc->_skipFrames = 1;
+        cam->cc->_waitKeyTimeout = 0;
+        if (sched) {
+            cam->attach(sched, 0, fps);
+        }
+        cams.push_back(std::move(cam));
+    }
+    auto rss_loaded = peak_rss_kb();
+    auto start = steady_clock::now();
+    for (auto& cam : cams) {
+        cam->start([](const cv::Mat&) {}, make_replay_source(source, frames));
+    }
+    for (auto& cam : cams) {
+        while (!cam->finished()) {
+            std::this_thread::sleep_for(milliseconds(10));
+        }
+    }
+    auto secs = duration<double>(steady_clock::now() - start).count();
+    cvl::camera_stats total;
+    for (auto& cam : cams) {
+        auto stats = cam->stats();
+        total.captured += stats.captured;
+        total.processed += stats.processed;
+        total.dropped_in += stats.dropped_in;
+        total.dropped_out += stats.dropped_out;
+        cam->stop();
+    }
+    std::cout << "{\"bench\":\"multicam\",\"source\":\"" << source
+              << "\",\"streams\":" << streams
+              << ",\"workers\":" << (sched ? (int)sched->workers() : streams)
+              << ",\"mask\":" << stages
+              << ",\"target_fps\":" << fps
+              << ",\"mean_batch\":" << (sched ? sched->mean_batch() : 0)
+              << ",\"captured\":" << total.captured
+              << ",\"processed\":" << total.processed
+              << ",\"fps\":" << total.processed / secs
+              << ",\"dropped_in\":" << total.dropped_in
+              << ",\"dropped_out\":" << total.dropped_out
+              << ",\"loaded_rss_kb\":" << rss_loaded
+              << ",\"peak_rss_kb\":" << peak_rss_kb() << "}" << std::endl;
+}
+
+#ifndef _WIN32
+
+// single session FTP server with a fixed delay before every control reply,
+// just enough of the protocol for npl::ftp to log in, CWD, MLST and MLSD
+struct ftp_standin {
+
+    ftp_standin(int latency_ms, size_t entries)
+        : m_latency(latency_ms), m_entries(entries) {
+        m_fd = listen_on(0, m_port);
+        m_thread = std::thread([this](){ serve(); });
+    }
+
+    ~ftp_standin() {
+        shutdown(m_fd, SHUT_RDWR);
+        close(m_fd);
+        m_thread.join();
+    }
+
+    int port(void) const { return m_port; }
+
+    private:
+
+    int m_fd = -1;
+    int m_port = 0;
+    int m_latency;
+    size_t m_entries;
+    std::thread m_thread;
+
+    static int listen_on(int port, int& bound) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in sa = {};
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(port);
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(fd, (sockaddr *)&sa, sizeof(sa));
+        listen(fd, 4);
+        socklen_t len = sizeof(sa);
+        getsockname(fd, (sockaddr *)&sa, &len);
+        bound = ntohs(sa.sin_port);
+        return fd;
+    }
+
+    void reply(int c, const std::string& r) {
+        std::this_thread::sleep_for(milliseconds(m_latency));
+        send(c, r.data(), r.size(), MSG_NOSIGNAL);
+    }
+
+    void serve(void) {
+        int c = accept(m_fd, nullptr, nullptr);
+        if (c < 0) return;
+        int pasv = -1;
+        std::string in;
+        reply(c, "220 stand-in\r\n");
+        char buf[4096];
+        for (ssize_t n; (n = recv(c, buf, sizeof(buf), 0)) > 0;) {
+            in.append(buf, n);
+            for (size_t eol; (eol = in.find("\r\n")) != std::string::npos;) {
+                auto line = in.substr(0, eol);
+                in.erase(0, eol + 2);
+                auto cmd = line.substr(0, 4);
+                auto arg = line.size() > 5 ? line.substr(5) : std::string();
+                if (cmd == "USER") {
+                    reply(c, "331 password required\r\n");
+                } else if (cmd == "PASS") {
+                    reply(c, "230 logged in\r\n");
+                } else if (cmd == "FEAT") {
+                    reply(c, "211-Features:\r\n MLSD\r\n MLST type*;size*;modify*;\r\n211 End\r\n");
+                } else if (cmd == "SYST") {
+                    reply(c, "215 UNIX Type: L8\r\n");
+                } else if (cmd == "PASV") {
+                    int port = 0;
+                    pasv = listen_on(0, port);
+                    reply(c, "227 Entering Passive Mode (127,0,0,1," +
+                        std::to_string(port >> 8) + "," + std::to_string(port & 0xFF) + ")\r\n");
+                } else if (cmd == "MLST") {
+                    reply(c, "250-Listing " + arg + "\r\n type=dir;modify=20221015170330; " +
+                        arg + "\r\n250 End\r\n");
+                } else if (cmd == "MLSD") {
+                    reply(c, "150 opening data connection\r\n");
+                    int d = accept(pasv, nullptr, nullptr);
+                    auto list = "type=cdir;modify=20221015170330; " + arg + "\r\n" +
+                        make_listing(npl::list_format::mlsd, m_entries);
+                    send(d, list.data(), list.size(), MSG_NOSIGNAL);
+                    close(d);
+                    close(pasv);
+                    reply(c, "226 transfer complete\r\n");
+                } else if (cmd == "QUIT") {
+                    reply(c, "221 bye\r\n");
+                    close(c);
+                    return;
+                } else {
+                    reply(c, "200 ok\r\n");
+                }
+            }
+        }
+        close(c);
+    }
+};
+
+// navigates back and forth between a few directories on a stand-in server,
+// listing every time and then through the lru listing cache
+static void bench_listing_cache(int latency, size_t entries, int navigations) {
+    npl::initialize_dispatcher();
+    ftp_standin server(latency, entries);
+    auto ftp = npl::make_ftp("127.0.0.1", server.port(), npl::tls::no);
+    std::promise<bool> login;
+    ftp->set_credentials("bench", "bench");
+    ftp->setCallback<TListenerOnLogin>({
+        [&](bool success) { login.set_value(success); }});
+    ftp->start_protocol_client();
+    if (!login.get_future().get()) {
+        std::cout << "{\"bench\":\"listing_cache\",\"error\":\"login\"}" << std::endl;
+        return;
+    }
+    auto list_directory = [&](const std::string& path) {
+        std::promise<size_t> done;
+        auto count = std::make_shared<size_t>(0);
+        auto parser = std::make_shared<npl::list_parser>(npl::list_format::mlsd,
+            [count](const npl::list_entry& e) { (*count)++; });
+        ftp->setCurrentDirectory(path);
+        ftp->Transfer(npl::ftp::list, path,
+            [&, parser, count](const char *b, size_t n) {
+                if (b) {
+                    parser->feed(b, n);
+                } else {
+                    parser->finish();
+                    done.set_value(*count);
+                }
+                return true;
+            });
+        return done.get_future().get();
+    };
+    const char *paths[] = { "/a", "/b", "/a/c" };
+    osl::lru_cache<std::string, size_t> cache(64, seconds(30));
+    for (auto cached : { false, true }) {
+        std::vector<double> samples;
+        for (int i = 0; i < navigations; i++) {
+            std::string path = paths[i % 3];
+            auto start = steady_clock::now();
+            size_t count = 0;
+            if (!cached || cache.get(path, count) == decltype(cache)::lookup::miss) {
+                count = list_directory(path);
+                if (cached) cache.put(path, count);
+            }
+            samples.push_back(duration<double, std::milli>(steady_clock::now() - start).count());
+        }
+        std::cout << "{\"bench\":\"listing_cache\",\"cached\":" << (cached ? "true" : "false")
+                  << ",\"latency_ms\":" << latency
+                  << ",\"entries\":" << entries
+                  << ",\"navigations\":" << navigations
+                  << ",\"p50_ms\":" << percentile(samples, 0.50)
+                  << ",\"p99_ms\":" << percentile(samples, 0.99) << "}" << std::endl;
+    }
+    ftp->quit();
+}
+
+// images a sparse file with data_pct of its 2M blocks written, serially
+// (readers = 0, page cache reads) and through the pipelined copy engine
+static void bench_copy(const std::string& dir, int gb, int data_pct, int depth, int readers) {
+    npl::initialize_dispatcher();
+    auto path = std::filesystem::path(dir) / "bench_copy.src";
+    uint64_t length = (uint64_t) gb << 30;
+    {
+        std::ofstream f(path, std::ios::binary | std::ios::trunc);
+        std::vector<char> block(_2M);
+        std::mt19937 rng(7);
+        for (auto& c : block) c = (char) rng();
+        for (uint64_t off = 0; off < length; off += _2M) {
+            if ((int)(rng() % 100) < data_pct) {
+                f.seekp(off);
+                f.write(block.data(), block.size());
+            }
+        }
+        f.close();
+        std::filesystem::resize_file(path, length);
+    }
+    for (auto format : { L"raw", L"d-vhd" }) {
+        for (auto pipelined : { false, true }) {
+            // start each run from a cold source
+            auto fd = open(path.c_str(), O_RDONLY);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+            auto out = std::filesystem::path(dir) / "bench_copy.out";
+            auto target = npl::make_file(out.wstring(), true);
+            fxc::copy_options options;
+            options.depth = depth;
+            options.readers = pipelined ? readers : 0;
+            options.direct = pipelined;
+            auto start = steady_clock::now();
+            fxc::createBaseVirtualDiskFromSource(format, path.wstring(), target, nullptr, options);
+            auto seconds = duration<double>(steady_clock::now() - start).count();
+            // the vhd writers detach their target when done
+            if (std::wstring(format) == L"raw") {
+                getSharedInstance<npl::dispatcher>()->remove_event_listener(target);
+            }
+            target.reset();
+            std::wcout << L"{\"bench\":\"copy\",\"format\":\"" << format << L"\""
+                       << L",\"pipelined\":" << (pipelined ? L"true" : L"false")
+                       << L",\"gb\":" << gb
+                       << L",\"data_pct\":" << data_pct
+                       << L",\"depth\":" << depth
+                       << L",\"readers\":" << options.readers
+                       << L",\"seconds\":" << seconds
+                       << L",\"source_gbps\":" << (length / 1e9) / seconds << L"}" << std::endl;
+            std::filesystem::remove(out);
+        }
+    }
+    std::filesystem::remove(path);
+}
+
+// random 4K and sequential 1M reads through differencing vhd chains of
+// each depth, walking every level per fragment vs the flattened block map
+static void bench_chain(const std::string& dir, int mb, int writes, int reads) {
+    npl::initialize_dispatcher();
+    auto folder = std::filesystem::path(dir) / "bench_chain";
+    std::filesystem::create_directories(folder);
+    auto volume = folder / "volume.img";
+    uint64_t length = (uint64_t) mb * _1M;
+    std::mt19937_64 rng(11);
+    {
+        std::ofstream f(volume, std::ios::binary | std::ios::trunc);
+        std::vector<char> block(_1M);
+        for (auto& c : block) c = (char) rng();
+        for (uint64_t off = 0; off < length; off += 8 * _1M) {
+            f.seekp(off);
+            f.write(block.data(), block.size());
+        }
+        f.close();
+        std::filesystem::resize_file(volume, length);
+    }
+    auto parent = folder / "level0.vhd";
+    fxc::createBaseVirtualDiskFromSource(L"d-vhd", volume.wstring(), npl::make_file(parent.wstring(), true), nullptr);
+    std::vector<uint8_t> sector(_4K, 0xC3);
+    int built = 0;
+    for (int depth : { 1, 10, 50 }) {
+        // each level rewrites a few 4K ranges anywhere on the disk
+        for (; built < depth - 1; built++) {
+            std::map<uint64_t, std::vector<fxc::DataBlockIO>> changes;
+            for (int i = 0; i < writes; i++) {
+                uint64_t off = (rng() % (length / _4K)) * _4K;
+                changes[off / _2M].push_back({_4K, off, nullptr});
+            }
+            for (auto& kv : changes) {
+                std::sort(kv.second.begin(), kv.second.end(), [](auto& a, auto& b) { return a.offset < b.offset; });
+            }
+            auto child = folder / ("level" + std::to_string(built + 1) + ".vhd");
+            fxc::write_child_vhd(parent.wstring(), npl::make_file(child.wstring(), true), changes,
+                [&](uint8_t *b, size_t l, uint64_t o) {
+                    memcpy(b, sector.data(), l);
+                    return (int32_t) l;
+                });
+            parent = child;
+        }
+        for (auto flatten : { false, true }) {
+            auto disk = fxc::get_virtual_disk(parent.wstring());
+            disk->iFlatten = flatten;
+            auto total = disk->getLogicalDiskLength();
+            auto buf = std::make_unique<uint8_t []>(_1M);
+            auto start = steady_clock::now();
+            for (int i = 0; i < reads; i++) {
+                disk->read_sync(buf.get(), _4K, (rng() % (total / _4K)) * _4K);
+            }
+            auto random_s = duration<double>(steady_clock::now() - start).count();
+            start = steady_clock::now();
+            for (uint64_t off = 0; off + _1M <= total; off += _1M) {
+                disk->read_sync(buf.get(), _1M, off);
+            }
+            auto sequential_s = duration<double>(steady_clock::now() - start).count();
+            std::cout << "{\"bench\":\"chain\",\"depth\":" << depth
+                      << ",\"flatten\":" << (flatten ? "true" : "false")
+                      << ",\"mb\":" << mb
+                      << ",\"random_4k_iops\":" << reads / random_s
+                      << ",\"sequential_mbps\":" << (total / 1e6) / sequential_s << "}" << std::endl;
+        }
+    }
+    std::filesystem::remove_all(folder);
+}
+
+// an image of 1M units, dup_pct of them copies of earlier ones shifted by a
+// few sectors and zero_pct written with zeroes, ingested with fixed and
+// content defined chunks, then once more as the next backup of the same volume
+static void bench_dedup(const std::string& dir, int mb, int dup_pct, int zero_pct) {
+    npl::initialize_dispatcher();
+    auto folder = std::filesystem::path(dir) / "bench_dedup";
+    std::filesystem::create_directories(folder);
+    auto volume = folder / "volume.img";
+    std::mt19937_64 rng(13);
+    {
+        std::ofstream f(volume, std::ios::binary | std::ios::trunc);
+        std::vector<char> unit(_1M), zero(_1M, 0);
+        std::vector<std::vector<char>> written;
+        for (int i = 0; i < mb; i++) {
+            auto dice = (int)(rng() % 100);
+            if (dice < zero_pct) {
+                f.write(zero.data(), zero.size());
+            } else if (dice < zero_pct + dup_pct && written.size()) {
+                auto& from = written[rng() % written.size()];
+                auto shift = (rng() % 64) * 512;
+                std::rotate_copy(from.begin(), from.begin() + shift, from.end(), unit.begin());
+                f.write(unit.data(), unit.size());
+            } else {
+                for (auto& c : unit) c = (char) rng();
+                f.write(unit.data(), unit.size());
+                if (written.size() < 64) written.push_back(unit);
+            }
+        }
+    }
+    for (auto mode : { fxc::chunking::fixed, fxc::chunking::cdc }) {
+        auto root = folder / "store";
+        std::filesystem::remove_all(root);
+        fxc::chunk_store store(root);
+        fxc::dedup_options options;
+        options.mode = mode;
+        for (auto pass : { 1, 2 }) {
+            auto fd = open(volume.c_str(), O_RDONLY);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+            fxc::manifest m;
+            fxc::dedup_stats stats;
+            fxc::dedup_backup(fxc::make_block_source(volume.wstring()), store, m, options, &stats);
+            std::cout << "{\"bench\":\"dedup\",\"mode\":\"" << (mode == fxc::chunking::cdc ? "cdc" : "fixed") << "\""
+                      << ",\"pass\":" << pass
+                      << ",\"mb\":" << mb
+                      << ",\"dup_pct\":" << dup_pct
+                      << ",\"zero_pct\":" << zero_pct
+                      << ",\"chunks\":" << stats.chunks
+                      << ",\"zero_mb\":" << stats.zero / _1M
+                      << ",\"stored_mb\":" << stats.stored / _1M
+                      << ",\"dedup_ratio\":" << stats.ratio()
+                      << ",\"ingest_gbps\":" << (stats.bytes / 1e9) / stats.seconds << "}" << std::endl;
+        }
+    }
+    std::filesystem::remove_all(folder);
+}
+
+// a d-vhd against containers of the same volume: 40% text like data, 40%
+// random, 20% zeroes. random reads are timed one by one, from a cold cache
+static void bench_container(const std::string& dir, int mb, int level, int block_kb, int reads) {
+    npl::initialize_dispatcher();
+    auto folder = std::filesystem::path(dir) / "bench_container";
+    std::filesystem::create_directories(folder);
+    auto volume = folder / "volume.img";
+    std::mt19937_64 rng(17);
+    {
+        std::ofstream f(volume, std::ios::binary | std::ios::trunc);
+        std::vector<char> unit(_1M);
+        const std::string words = "offset backup volume snapshot block index ";
+        for (int i = 0; i < mb; i++) {
+            auto dice = (int)(rng() % 100);
+            for (size_t j = 0; j < unit.size(); j++) {
+                unit[j] = (dice < 20) ? 0 : (dice < 60) ? words[(j + (rng() % 3)) % words.size()] : (char) rng();
+            }
+            f.write(unit.data(), unit.size());
+        }
+    }
+    struct variant {
+        const char *name;
+        std::wstring format;
+        std::string passphrase;
+    };
+    std::vector<variant> variants = {
+        { "d-vhd", L"d-vhd", "" },
+        { "c-fxc", L"c-fxc", "" },
+        { "c-fxc+aes", L"c-fxc", "bench" },
+    };
+    for (const auto& v : variants) {
+        auto image = folder / "image";
+        fxc::container_options coptions;
+        coptions.level = level;
+        coptions.block = block_kb * _1K;
+        coptions.passphrase = v.passphrase;
+        auto start = steady_clock::now();
+        fxc::createBaseVirtualDiskFromSource(v.format, volume.wstring(),
+            npl::make_file(image.wstring(), true), nullptr, {}, coptions);
+        auto write_s = duration<double>(steady_clock::now() - start).count();
+        auto size = std::filesystem::file_size(image);
+        auto fd = open(image.c_str(), O_RDONLY);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        auto disk = fxc::get_virtual_disk(image.wstring(), v.passphrase);
+        auto base = disk->getPartitionStartOffset(0);
+        uint64_t total = (uint64_t) mb * _1M;
+        auto buf = std::make_unique<uint8_t []>(_1M);
+        std::vector<double> latency;
+        for (int i = 0; i < reads; i++) {
+            auto begin = steady_clock::now();
+            disk->read_sync(buf.get(), _4K, base + (rng() % (total / _4K)) * _4K);
+            latency.push_back(duration<double, std::micro>(steady_clock::now() - begin).count());
+        }
+        std::sort(latency.begin(), latency.end());
+        start = steady_clock::now();
+        for (uint64_t off = 0; off < total; off += _1M) {
+            disk->read_sync(buf.get(), _1M, base + off);
+        }
+        auto sequential_s = duration<double>(steady_clock::now() - start).count();
+        disk.reset();
+        std::cout << "{\"bench\":\"container\",\"format\":\"" << v.name << "\""
+                  << ",\"mb\":" << mb
+                  << ",\"level\":" << level
+                  << ",\"block_kb\":" << block_kb
+                  << ",\"image_mb\":" << size / _1M
+                  << ",\"ratio\":" << (double) total / (double) size
+                  << ",\"write_mbps\":" << (total / 1e6) / write_s
+                  << ",\"random_4k_p50_us\":" << latency[latency.size() / 2]
+                  << ",\"random_4k_p99_us\":" << latency[latency.size() * 99 / 100]
+                  << ",\"sequential_mbps\":" << (total / 1e6) / sequential_s << "}" << std::endl;
+    }
+    std::filesystem::remove_all(folder);
+}
+
+// verify of d-vhd and d-vhdx images of a random volume against their
+// checksum sidecars, warm and cold, on 1 up to threads readers. then flips
+// single bits in random payload blocks and counts the blocks verify flags
+static void bench_verify(const std::string& dir, int mb, int threads, int flips) {
+    npl::initialize_dispatcher();
+    auto folder = std::filesystem::path(dir) / "bench_verify";
+    std::filesystem::create_directories(folder);
+    auto volume = folder / "volume.img";
+    std::mt19937_64 rng(23);
+    {
+        std::ofstream f(volume, std::ios::binary | std::ios::trunc);
+        std::vector<uint64_t> unit(_1M / 8);
+        for (int i = 0; i < mb; i++) {
+            for (auto& w : unit) {
+                w = rng();
+            }
+            f.write((const char *) unit.data(), _1M);
+        }
+    }
+    auto drop = [](const std::filesystem::path& path) {
+        auto fd = open(path.c_str(), O_RDONLY);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    };
+    for (auto format : {L"d-vhd", L"d-vhdx"}) {
+        auto image = folder / "image";
+        fxc::copy_options options;
+        options.manifest = image.wstring() + L".crc";
+        fxc::createBaseVirtualDiskFromSource(format, volume.wstring(),
+            npl::make_file(image.wstring(), true), nullptr, options);
+        fxc::verify_options voptions;
+        voptions.manifest = options.manifest;
+        fxc::verify_report report;
+        for (int t = 1; t <= threads; t *= 2) {
+            voptions.threads = t;
+            for (auto cold : {true, false}) {
+                if (cold) {
+                    drop(image);
+                }
+                report = fxc::verify_virtual_disk(image.wstring(), voptions);
+                std::cout << "{\"bench\":\"verify\",\"format\":\"" << osl::ws2s(format) << "\""
+                          << ",\"mb\":" << mb
+                          << ",\"threads\":" << t
+                          << ",\"cache\":\"" << (cold ? "cold" : "warm") << "\""
+                          << ",\"blocks\":" << report.blocks
+                          << ",\"ok\":" << report.ok()
+                          << ",\"gbps\":" << report.gbps() << "}" << std::endl;
+            }
+        }
+        // one flipped bit in each of flips distinct payload blocks
+        std::vector<uint64_t> blocks;
+        for (const auto& [block, e] : report.sums.entries()) {
+            if (block) {
+                blocks.push_back(block);
+            }
+        }
+        std::shuffle(blocks.begin(), blocks.end(), rng);
+        blocks.resize(std::min<size_t>(flips, blocks.size()));
+        std::sort(blocks.begin(), blocks.end());
+        std::vector<uint64_t> offsets;
+        {
+            auto disk = fxc::get_virtual_disk(image.wstring());
+            for (auto block : blocks) {
+                uint64_t off = 0;
+                if (auto v = std::dynamic_pointer_cast<fxc::vhd>(disk)) {
+                    off = (osl::endian_reverse(v->iBAT[block]) * 512ULL) + 512;
+                } else if (auto v = std::dynamic_pointer_cast<fxc::vhdx>(disk)) {
+                    off = VHDX_BAT_ENTRY_GET_FILE_OFFSET(v->iBAT[block + block / v->chunk_ratio]);
+                }
+                offsets.push_back(off + rng() % disk->getBlockSize());
+            }
+        }
+        auto fd = open(image.c_str(), O_RDWR);
+        for (auto off : offsets) {
+            uint8_t byte = 0;
+            pread(fd, &byte, 1, off);
+            byte ^= (uint8_t)(1 << (rng() % 8));
+            pwrite(fd, &byte, 1, off);
+        }
+        close(fd);
+        voptions.threads = threads;
+        report = fxc::verify_virtual_disk(image.wstring(), voptions);
+        std::cout << "{\"bench\":\"verify\",\"format\":\"" << osl::ws2s(format) << "\""
+                  << ",\"flipped\":" << blocks.size()
+                  << ",\"detected\":" << report.bad.size()
+                  << ",\"exact\":" << (report.bad == blocks)
+                  << ",\"structure_ok\":" << report.problems.empty() << "}" << std::endl;
+    }
+    std::filesystem::remove_all(folder);
+}
+
+// incremental backups found by hashing: a full d-vhd/d-vhdx of a sparse
+// random volume with free % of it holes, then a chain of children after
+// 1%, 10% and 50% of the in use grains changed. reports the time, the bytes
+// hashed and the bytes the child took against a full backup's
+static void bench_incremental(const std::string& dir, int mb, int free) {
+    npl::initialize_dispatcher();
+    auto folder = std::filesystem::path(dir) / "bench_incremental";
+    std::filesystem::create_directories(folder);
+    auto volume = folder / "volume.img";
+    uint64_t length = (uint64_t) mb * _1M;
+    std::mt19937_64 rng(29);
+    std::vector<uint64_t> used;
+    auto fd = open(volume.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0640);
+    ftruncate(fd, length);
+    {
+        std::vector<uint64_t> unit(_1M / 8);
+        for (int g = 0; g < mb; g++) {
+            if ((int)(rng() % 100) < free) {
+                continue;
+            }
+            for (auto& w : unit) {
+                w = rng();
+            }
+            pwrite(fd, unit.data(), _1M, (uint64_t) g * _1M);
+            used.push_back(g);
+        }
+    }
+    fsync(fd);
+    for (auto format : {L"vhd", L"vhdx"}) {
+        auto parent = folder / (std::wstring(L"full.") + format);
+        fxc::copy_options options;
+        options.hashes = parent.wstring() + L".hashes";
+        auto start = steady_clock::now();
+        fxc::createBaseVirtualDiskFromSource(std::wstring(L"d-") + format, volume.wstring(),
+            npl::make_file(parent.wstring(), true), nullptr, options);
+        double seconds = duration<double>(steady_clock::now() - start).count();
+        auto full = std::filesystem::file_size(parent);
+        std::cout << "{\"bench\":\"incremental\",\"format\":\"" << osl::ws2s(format) << "\""
+                  << ",\"mb\":" << mb
+                  << ",\"churn\":\"full\""
+                  << ",\"grains\":" << used.size()
+                  << ",\"seconds\":" << seconds
+                  << ",\"written\":" << full << "}" << std::endl;
+        for (int churn : {1, 10, 50}) {
+            // one 4K write in each of churn % of the in use grains
+            auto grains = used;
+            std::shuffle(grains.begin(), grains.end(), rng);
+            grains.resize(grains.size() * churn / 100);
+            std::vector<uint64_t> page(_4K / 8);
+            for (auto g : grains) {
+                for (auto& w : page) {
+                    w = rng();
+                }
+                pwrite(fd, page.data(), _4K, g * _1M + (rng() % (_1M / _4K)) * _4K);
+            }
+            fsync(fd);
+            auto child = folder / (std::wstring(L"churn") + std::to_wstring(churn) + L"." + format);
+            options.hashes = child.wstring() + L".hashes";
+            fxc::change_stats stats;
+            start = steady_clock::now();
+            auto ok = fxc::create_child_from_hashes(format, fxc::make_block_source(volume.wstring()),
+                parent.wstring(), npl::make_file(child.wstring(), true), options, &stats);
+            seconds = duration<double>(steady_clock::now() - start).count();
+            auto written = std::filesystem::file_size(child);
+            std::cout << "{\"bench\":\"incremental\",\"format\":\"" << osl::ws2s(format) << "\""
+                      << ",\"mb\":" << mb
+                      << ",\"churn\":" << churn
+                      << ",\"ok\":" << ok
+                      << ",\"grains\":" << stats.grains
+                      << ",\"changed\":" << stats.changed
+                      << ",\"exact\":" << (stats.changed == grains.size())
+                      << ",\"hashed_mb\":" << stats.bytes / _1M
+                      << ",\"hash_seconds\":" << stats.seconds
+                      << ",\"seconds\":" << seconds
+                      << ",\"written\":" << written
+                      << ",\"of_full\":" << (double) written / full << "}" << std::endl;
+            parent = child;
+        }
+    }
+    close(fd);
+    std::filesystem::remove_all(folder);
+}
+
+// chain merges: a full d-vhd/d-vhdx of a random volume and levels children
+// with 4K writes in churn % of the grains each. the two newest levels are
+// merged, then the rest into a synthetic full, with and without the read
+// back validation. the leaf is read whole before and after each merge and
+// its crc32c has to hold
+static void bench_merge(const std::string& dir, int mb, int levels, int churn) {
+    npl::initialize_dispatcher();
+    auto folder = std::filesystem::path(dir) / "bench_merge";
+    std::filesystem::create_directories(folder);
+    auto volume = folder / "volume.img";
+    uint64_t length = (uint64_t) mb * _1M;
+    std::mt19937_64 rng(31);
+    auto fd = open(volume.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0640);
+    {
+        std::vector<uint64_t> unit(_1M / 8);
+        for (int g = 0; g < mb; g++) {
+            for (auto& w : unit) {
+                w = rng();
+            }
+            pwrite(fd, unit.data(), _1M, (uint64_t) g * _1M);
+        }
+    }
+    fsync(fd);
+    // crc32c and seconds of the leaf's volume, read through the chain
+    auto read_leaf = [&](const std::wstring& leaf, size_t& depth) {
+        auto disk = fxc::get_virtual_disk(leaf);
+        depth = disk->getChain().size();
+        std::vector<uint8_t> buf(_4M);
+        uint32_t crc = 0;
+        uint64_t pstart = disk->getPartitionStartOffset(0);
+        auto start = steady_clock::now();
+        for (uint64_t off = 0; off < length; off += _4M) {
+            auto n = (size_t) std::min<uint64_t>(_4M, length - off);
+            disk->read_sync(buf.data(), n, pstart + off);
+            crc = crc32c_extend(crc, buf.data(), n);
+        }
+        return std::make_pair(crc, duration<double>(steady_clock::now() - start).count());
+    };
+    for (auto format : {L"vhd", L"vhdx"}) {
+        for (bool validate : {false, true}) {
+            std::wstring prefix = std::wstring(validate ? L"v" : L"n") + format;
+            auto parent = folder / (prefix + L"-0." + format);
+            fxc::copy_options options;
+            options.hashes = parent.wstring() + L".hashes";
+            fxc::createBaseVirtualDiskFromSource(std::wstring(L"d-") + format, volume.wstring(),
+                npl::make_file(parent.wstring(), true), nullptr, options);
+            for (int level = 1; level <= levels; level++) {
+                std::vector<uint64_t> page(_4K / 8);
+                for (int g = 0; g < mb; g++) {
+                    if ((int)(rng() % 100) >= churn) {
+                        continue;
+                    }
+                    for (auto& w : page) {
+                        w = rng();
+                    }
+                    pwrite(fd, page.data(), _4K, (uint64_t) g * _1M + (rng() % (_1M / _4K)) * _4K);
+                }
+                fsync(fd);
+                auto child = folder / (prefix + L"-" + std::to_wstring(level) + L"." + format);
+                options.hashes = child.wstring() + L".hashes";
+                fxc::create_child_from_hashes(format, fxc::make_block_source(volume.wstring()),
+                    parent.wstring(), npl::make_file(child.wstring(), true), options);
+                parent = child;
+            }
+            auto leaf = parent.wstring();
+            size_t depth = 0;
+            auto before = read_leaf(leaf, depth);
+            // the newest two levels, then all that is left
+            for (size_t count : {(size_t) 2, (size_t) levels}) {
+                size_t from = depth;
+                fxc::merge_stats stats;
+                auto ok = fxc::merge_virtual_disk(leaf, 0, count, validate, {}, &stats);
+                auto after = read_leaf(leaf, depth);
+                std::cout << "{\"bench\":\"merge\",\"format\":\"" << osl::ws2s(format) << "\""
+                          << ",\"mb\":" << mb
+                          << ",\"churn\":" << churn
+                          << ",\"validate\":" << validate
+                          << ",\"levels\":" << count
+                          << ",\"depth\":\"" << from << "->" << depth << "\""
+                          << ",\"ok\":" << ok
+                          << ",\"blocks\":" << stats.blocks
+                          << ",\"written\":" << stats.bytes
+                          << ",\"seconds\":" << stats.seconds
+                          << ",\"gbps\":" << stats.gbps()
+                          << ",\"equal\":" << (after.first == before.first)
+                          << ",\"read_seconds\":\"" << before.second << "->" << after.second << "\"}" << std::endl;
+                before = after;
+            }
+        }
+    }
+    close(fd);
+    std::filesystem::remove_all(folder);
+}
+
+// reads over nbd from 127.0.0.1, depth requests in flight per connection
+struct nbd_bench_client {
+
+    int fd = -1;
+    uint64_t size = 0;
+
+    bool recv_all(void *b, size_t l) {
+        for (size_t done = 0; done < l; ) {
+            auto n = ::recv(fd, (char *)b + done, l - done, 0);
+            if (n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    // fixed newstyle without zeroes, NBD_OPT_EXPORT_NAME for the default export
+    bool connect(uint16_t port) {
+        fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        uint8_t hello[18], info[10];
+        if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) || !recv_all(hello, sizeof(hello))) {
+            return false;
+        }
+        uint32_t flags = osl::endian_reverse<uint32_t>(3);
+        uint8_t opt[16] = { 'I', 'H', 'A', 'V', 'E', 'O', 'P', 'T', 0, 0, 0, 1, 0, 0, 0, 0 };
+        ::send(fd, &flags, 4, 0);
+        ::send(fd, opt, sizeof(opt), 0);
+        if (!recv_all(info, sizeof(info))) {
+            return false;
+        }
+        memcpy(&size, info, 8);
+        size = osl::endian_reverse(size);
+        return size > 0;
+    }
+
+    bool read(uint64_t handle, uint64_t offset, uint32_t length) {
+        uint8_t req[28] = { 0x25, 0x60, 0x95, 0x13 };
+        offset = osl::endian_reverse(offset);
+        length = osl::endian_reverse(length);
+        memcpy(req + 8, &handle, 8);
+        memcpy(req + 16, &offset, 8);
+        memcpy(req + 24, &length, 4);
+        return ::send(fd, req, sizeof(req), MSG_NOSIGNAL) == sizeof(req);
+    }
+
+    bool reply(std::vector<uint8_t>& buf, const std::map<uint64_t, uint32_t>& lengths) {
+        uint8_t hdr[16];
+        uint64_t handle;
+        if (!recv_all(hdr, sizeof(hdr)) || hdr[4] || hdr[5] || hdr[6] || hdr[7]) {
+            return false;
+        }
+        memcpy(&handle, hdr + 8, 8);
+        auto it = lengths.find(handle);
+        return it != lengths.end() && recv_all(buf.data(), it->second);
+    }
+
+    ~nbd_bench_client() {
+        if (fd >= 0) {
+            uint8_t disc[28] = { 0x25, 0x60, 0x95, 0x13, 0, 0, 0, 2 };
+            ::send(fd, disc, sizeof(disc), MSG_NOSIGNAL);
+            ::close(fd);
+        }
+    }
+};
+
+// an nbd export of a d-vhd of a random volume, read by clients connections
+// of depth requests in flight each: sequentially in 128K requests over
+// disjoint ranges and at random in 4K ones, with and without read-ahead.
+// the image starts each run out of the page cache
+static void bench_nbd(const std::string& dir, int mb, int clients, int depth, int seconds) {
+    npl::initialize_dispatcher();
+    auto folder = std::filesystem::path(dir) / "bench_nbd";
+    std::filesystem::create_directories(folder);
+    auto volume = folder / "volume.img";
+    {
+        std::mt19937_64 rng(31);
+        std::ofstream f(volume, std::ios::binary | std::ios::trunc);
+        std::vector<uint64_t> unit(_1M / 8);
+        for (int i = 0; i < mb; i++) {
+            for (auto& w : unit) {
+                w = rng();
+            }
+            f.write((const char *) unit.data(), _1M);
+        }
+    }
+    auto image = folder / "image.vhd";
+    fxc::createBaseVirtualDiskFromSource(L"d-vhd", volume.wstring(), npl::make_file(image.wstring(), true), nullptr);
+    for (auto workload : {"sequential", "random"}) {
+        for (uint32_t readahead : {0, _1M}) {
+            auto fd = open(image.c_str(), O_RDONLY);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+            fxc::nbd_options options;
+            options.workers = 4;
+            options.readahead = readahead;
+            auto server = fxc::serve_virtual_disk(image.wstring(), options);
+            auto port = server ? server->listen_tcp(0) : 0;
+            if (!port) {
+                std::cout << "{\"bench\":\"nbd\",\"error\":\"no server\"}" << std::endl;
+                return;
+            }
+            bool sequential = (std::string(workload) == "sequential");
+            uint32_t len = sequential ? 128 * _1K : _4K;
+            std::atomic<uint64_t> bytes{0}, requests{0}, failed{0};
+            auto stop = steady_clock::now() + std::chrono::seconds(seconds);
+            std::vector<std::thread> threads;
+            for (int c = 0; c < clients; c++) {
+                threads.emplace_back([&, c]() {
+                    nbd_bench_client client;
+                    if (!client.connect(port)) {
+                        failed++;
+                        return;
+                    }
+                    std::mt19937_64 rng(c);
+                    uint64_t span = client.size / clients;
+                    uint64_t pos = 0;
+                    std::map<uint64_t, uint32_t> lengths;
+                    std::vector<uint8_t> buf(len);
+                    auto next = [&]() {
+                        if (sequential) {
+                            auto off = c * span + pos;
+                            pos = (pos + len + len > span) ? 0 : pos + len;
+                            return off;
+                        }
+                        return (rng() % (client.size / len)) * len;
+                    };
+                    for (uint64_t h = 0; h < (uint64_t) depth; h++) {
+                        lengths[h] = len;
+                        client.read(h, next(), len);
+                    }
+                    for (uint64_t h = depth; steady_clock::now() < stop; h++) {
+                        if (!client.reply(buf, lengths)) {
+                            failed++;
+                            return;
+                        }
+                        bytes += len;
+                        requests++;
+                        lengths[h] = len;
+                        client.read(h, next(), len);
+                    }
+                    for (int i = 0; i < depth; i++) {
+                        client.reply(buf, lengths);
+                    }
+                });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+            auto stats = server->stats();
+            server.reset();
+            std::cout << "{\"bench\":\"nbd\",\"workload\":\"" << workload << "\""
+                      << ",\"readahead_kb\":" << readahead / _1K
+                      << ",\"clients\":" << clients
+                      << ",\"depth\":" << depth
+                      << ",\"failed\":" << failed
+                      << ",\"iops\":" << requests / seconds
+                      << ",\"mbps\":" << (double) bytes / seconds / _1M
+                      << ",\"hits\":" << stats.hits
+                      << ",\"misses\":" << stats.misses
+                      << ",\"prefetched\":" << stats.prefetched << "}" << std::endl;
+        }
+    }
+    std::filesystem::remove_all(folder);
+}
+#endif
+
+// a volume that is only an allocation bitmap
+struct synthetic_source : public fxc::block_source {
+
+    synthetic_source(uint64_t length, uint32_t cluster)
+        : _length(length), _cluster(cluster), _bitmap((length / cluster + 7) / 8, 0) {}
+
+    virtual uint64_t length(void) override {
+        return _length;
+    }
+
+    virtual uint32_t cluster_size(void) override {
+        return _cluster;
+    }
+
+    virtual int32_t read_sync(uint8_t *b, size_t l, uint64_t o) override {
+        return 0;
+    }
+
+    std::vector<uint8_t>& bits(void) {
+        return _bitmap;
+    }
+
+    protected:
+
+    virtual const uint8_t *bitmap(void) override {
+        return _bitmap.data();
+    }
+
+    private:
+
+    uint64_t _length;
+    uint32_t _cluster;
+    std::vector<uint8_t> _bitmap;
+};
+
+// bat construction over a synthetic volume bitmap, the cluster by cluster
+// loop against the word scan, and vhd sector bitmaps of 2M blocks walked
+// bit by bit against run extraction
+static void bench_bitmap(int tb, int cluster_kb, int sector_mb) {
+    constexpr uint64_t bs = _2M;
+    auto source = std::make_shared<synthetic_source>((uint64_t) tb << 40, cluster_kb * _1K);
+    uint64_t clusters = source->clusters();
+    std::mt19937_64 rng(19);
+    for (std::string pattern : { "empty", "full", "extents", "fragmented", "random" }) {
+        auto& bits = source->bits();
+        std::fill(bits.begin(), bits.end(), 0);
+        if (pattern == "full") {
+            std::fill(bits.begin(), bits.end(), 0xFF);
+        } else if (pattern == "random") {
+            for (size_t i = 0; i + 8 <= bits.size(); i += 8) {
+                auto word = rng();
+                memcpy(bits.data() + i, &word, 8);
+            }
+        } else if (pattern != "empty") {
+            // runs and gaps averaging 1M, or 4 clusters
+            uint64_t mean = (pattern == "extents") ? _1M / source->cluster_size() : 4;
+            for (uint64_t pos = rng() % (2 * mean); pos < clusters; pos += 1 + rng() % (2 * mean)) {
+                auto count = std::min<uint64_t>(1 + rng() % (2 * mean), clusters - pos);
+                fxc::set_bits<fxc::bit_order::lsb>(bits.data(), pos, count);
+                pos += count;
+            }
+        }
+        auto start = steady_clock::now();
+        std::vector<bool> loop;
+        bool inUse = false;
+        for (uint64_t i = 1; i <= clusters; i++) {
+            if (source->in_use(i - 1)) {
+                inUse = true;
+            }
+            if (((i * source->cluster_size()) % bs == 0) || (i == clusters)) {
+                loop.push_back(inUse);
+                inUse = false;
+            }
+        }
+        auto loop_s = duration<double>(steady_clock::now() - start).count();
+        start = steady_clock::now();
+        auto scan = source->in_use_blocks(bs);
+        auto scan_s = duration<double>(steady_clock::now() - start).count();
+        // the same bytes as msb first sector bitmaps, one per block
+        uint64_t sectors = bs / 512;
+        uint64_t windows = std::min<uint64_t>(bits.size(), (uint64_t) sector_mb * _1M) / (sectors / 8);
+        uint64_t loop_runs = 0, scan_runs = 0;
+        start = steady_clock::now();
+        for (uint64_t w = 0; w < windows; w++) {
+            auto sb = bits.data() + w * (sectors / 8);
+            uint64_t run_len = 0;
+            for (uint64_t i = 0; i < sectors; i++) {
+                if (sb[i / 8] & (1u << (7 - (i % 8)))) {
+                    run_len++;
+                } else if (run_len) {
+                    loop_runs++;
+                    run_len = 0;
+                }
+            }
+            loop_runs += run_len ? 1 : 0;
+        }
+        auto sector_loop_s = duration<double>(steady_clock::now() - start).count();
+        start = steady_clock::now();
+        for (uint64_t w = 0; w < windows; w++) {
+            auto sb = bits.data() + w * (sectors / 8);
+            scan_runs += fxc::bitmap_scan<fxc::bit_order::msb>(sb, sectors).runs(0, sectors).size();
+        }
+        auto sector_scan_s = duration<double>(steady_clock::now() - start).count();
+        std::cout << "{\"bench\":\"bitmap\",\"pattern\":\"" << pattern << "\""
+                  << ",\"tb\":" << tb
+                  << ",\"cluster_kb\":" << cluster_kb
+                  << ",\"blocks_in_use\":" << std::count(scan.begin(), scan.end(), true)
+                  << ",\"match\":" << ((loop == scan && loop_runs == scan_runs) ? "true" : "false")
+                  << ",\"bat_loop_s\":" << loop_s
+                  << ",\"bat_scan_s\":" << scan_s
+                  << ",\"sector_bitmaps\":" << windows
+                  << ",\"sector_loop_s\":" << sector_loop_s
+                  << ",\"sector_scan_s\":" << sector_scan_s << "}" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    auto arguments = osl::GetArgumentsVector<char>(argc, argv);
+    auto name = arguments.size() ? arguments[0] : std::string();
+    if (name == "listing") {
+        bench_listing(
+            (arguments.size() > 1) ? std::stoull(arguments[1]) : 1000000,
+            (arguments.size() > 2) ? std::stoull(arguments[2]) : _64K);
+    } else if (name == "frame_queue") {
+        bench_frame_queue(
+            (arguments.size() > 1) ? std::stoi(arguments[1]) : 600,
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 60,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 0);
+    } else if (name == "replay") {
+        bench_replay(
+            (arguments.size() > 1) ? arguments[1] : "synthetic",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 300,
+            (arguments.size() > 3) ? arguments[3] : "");
+    } else if (name == "cascade") {
+        bench_cascade(
+            (arguments.size() > 1) ? arguments[1] : "synthetic",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 300,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 1 | 2 | 8);
+    } else if (name == "motion") {
+        bench_motion(
+            (arguments.size() > 1) ? arguments[1] : "synthetic",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 300,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 320);
+    } else if (name == "markers") {
+        bench_markers(
+            (arguments.size() > 1) ? std::stoi(arguments[1]) : 3600,
+            (arguments.size() > 2) ? arguments[2] : "all");
+    } else if (name == "tracking") {
+        bench_tracking(
+            (arguments.size() > 1) ? std::stoi(arguments[1]) : 200,
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 5,
+            (arguments.size() > 3) ? arguments[3] : "all",
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 0);
+    } else if (name == "snapshots") {
+        bench_snapshots(
+            (arguments.size() > 1) ? std::stoi(arguments[1]) : 5000,
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 4,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 2,
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 64,
+            (arguments.size() > 5) ? std::stoi(arguments[5]) : 8,
+            (arguments.size() > 6) ? std::stoi(arguments[6]) : 90,
+            (arguments.size() > 7) ? arguments[7] : "oldest");
+    } else if (name == "multicam") {
+        bench_multicam(
+            (arguments.size() > 1) ? std::stoi(arguments[1]) : 16,
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 4,
+            (arguments.size() > 3) ? arguments[3] : "synthetic",
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 300,
+            (arguments.size() > 5) ? std::stoi(arguments[5]) : 2,
+            (arguments.size() > 6) ? std::stod(arguments[6]) : 0,
+            (arguments.size() > 7) ? std::stoi(arguments[7]) : 0);
+    } else if (name == "faceindex") {
+        bench_faceindex(
+            (arguments.size() > 1) ? std::stoull(arguments[1]) : 100000,
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 128,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 64,
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 1000);
+    #ifndef _WIN32
+    } else if (name == "listing_cache") {
+        bench_listing_cache(
+            (arguments.size() > 1) ? std::stoi(arguments[1]) : 20,
+            (arguments.size() > 2) ? std::stoull(arguments[2]) : 10000,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 30);
+    } else if (name == "copy") {
+        bench_copy(
+            (arguments.size() > 1) ? arguments[1] : ".",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 20,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 10,
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 8,
+            (arguments.size() > 5) ? std::stoi(arguments[5]) : 2);
+    } else if (name == "chain") {
+        bench_chain(
+            (arguments.size() > 1) ? arguments[1] : ".",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 1024,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 64,
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 20000);
+    } else if (name == "dedup") {
+        bench_dedup(
+            (arguments.size() > 1) ? arguments[1] : ".",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 2048,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 30,
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 10);
+    } else if (name == "bitmap") {
+        bench_bitmap(
+            (arguments.size() > 1) ? std::stoi(arguments[1]) : 16,
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 4,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 64);
+    } else if (name == "container") {
+        bench_container(
+            (arguments.size() > 1) ? arguments[1] : ".",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 1024,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 1,
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 1024,
+            (arguments.size() > 5) ? std::stoi(arguments[5]) : 2000);
+    } else if (name == "verify") {
+        bench_verify(
+            (arguments.size() > 1) ? arguments[1] : ".",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 2048,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 4,
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 16);
+    } else if (name == "incremental") {
+        bench_incremental(
+            (arguments.size() > 1) ? arguments[1] : ".",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 1024,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 25);
+    } else if (name == "nbd") {
+        bench_nbd(
+            (arguments.size() > 1) ? arguments[1] : ".",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 1024,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 4,
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 8,
+            (arguments.size() > 5) ? std::stoi(arguments[5]) : 5);
+    } else if (name == "merge") {
+        bench_merge(
+            (arguments.size() > 1) ? arguments[1] : ".",
+            (arguments.size() > 2) ? std::stoi(arguments[2]) : 1024,
+            (arguments.size() > 3) ? std::stoi(arguments[3]) : 4,
+            (arguments.size() > 4) ? std::stoi(arguments[4]) : 10);
+    #endif
+    } else {
+        std::cout << "bench listing [lines] [chunk]" << std::endl;
+        std::cout << "bench frame_queue [frames] [fps] [work ms]" << std::endl;
+        std::cout << "bench replay [video file|synthetic|static] [frames] [face|object|motion|facerec|length]" << std::endl;
+        std::cout << "bench cascade [video file|synthetic|static] [frames] [stage mask]" << std::endl;
+        std::cout << "bench motion [video file|synthetic|static] [frames] [width]" << std::endl;
+        std::cout << "bench markers [seconds per mode] [legacy|cached|roi|all]" << std::endl;
+        std::cout << "bench tracking [frames] [detect interval] [auto|csrt|kcf|mosse|all] [threads, 1 = serial]" << std::endl;
+        std::cout << "bench snapshots [count] [producers] [threads] [capacity] [batch] [quality] [oldest|newest|block]" << std::endl;
+        std::cout << "bench faceindex [max identities] [dim] [ef] [queries]" << std::endl;
+        std::cout << "bench multicam [streams] [workers, 0 = thread per camera] [video file|synthetic] [frames] [stage mask] [fps] [batch]" << std::endl;
+        std::cout << "bench listing_cache [latency ms] [entries] [navigations]" << std::endl;
+        std::cout << "bench copy [dir] [source gb] [data %] [depth] [readers]" << std::endl;
+        std::cout << "bench chain [dir] [disk mb] [4K writes per level] [random reads]" << std::endl;
+        std::cout << "bench dedup [dir] [image mb] [duplicate %] [zero %]" << std::endl;
+        std::cout << "bench bitmap [volume tb] [cluster kb] [sector bitmap mb]" << std::endl;
+        std::cout << "bench container [dir] [volume mb] [zlib level] [block kb] [random reads]" << std::endl;
+        std::cout << "bench verify [dir] [volume mb] [threads] [flipped blocks]" << std::endl;
+        std::cout << "bench incremental [dir] [volume mb] [free %]" << std::endl;
+        std::cout << "bench nbd [dir] [volume mb] [clients] [depth] [seconds per run]" << std::endl;
+        std::cout << "bench merge [dir] [volume mb] [levels] [churn %]" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef ASSIGNMENT_HPP
+#define ASSIGNMENT_HPP
+
+#include <limits>
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+namespace cvl {
+
+// minimum cost assignment (hungarian, kuhn-munkres with potentials, o(n^2 m)).
+// cost is row major rows x cols. returns the column given to each row, -1
+// for the rows left over when there are more rows than columns
+inline std::vector<int> hungarian(const std::vector<double>& cost, size_t rows, size_t cols) {
+    if (!rows || !cols) {
+        return std::vector<int>(rows, -1);
+    }
+    if (rows > cols) {
+        std::vector<double> transposed(cost.size());
+        for (size_t r = 0; r < rows; r++) {
+            for (size_t c = 0; c < cols; c++) {
+                transposed[c * rows + r] = cost[r * cols + c];
+            }
+        }
+        auto by_col = hungarian(transposed, cols, rows);
+        std::vector<int> out(rows, -1);
+        for (size_t c = 0; c < cols; c++) {
+            if (by_col[c] >= 0) {
+                out[by_col[c]] = (int)c;
+            }
+        }
+        return out;
+    }
+    // 1 based, column 0 is the virtual start of each augmenting path
+    const auto inf = std::numeric_limits<double>::infinity();
+    std::vector<double> u(rows + 1), v(cols + 1), minv(cols + 1);
+    std::vector<size_t> p(cols + 1), way(cols + 1);
+    std::vector<char> used(cols + 1);
+    for (size_t i = 1; i <= rows; i++) {
+        p[0] = i;
+        size_t j0 = 0;
+        std::fill(minv.begin(), minv.end(), inf);
+        std::fill(used.begin(), used.end(), 0);
+        do {
+            used[j0] = 1;
+            size_t i0 = p[j0], j1 = 0;
+            double delta = inf;
+            for (size_t j = 1; j <= cols; j++) {
+                if (used[j]) {
+                    continue;
+                }
+                auto current = cost[(i0 - 1) * cols + (j - 1)] - u[i0] - v[j];
+                if (current < minv[j]) {
+                    minv[j] = current;
+                    way[j] = j0;
+                }
+                if (minv[j] < delta) {
+                    delta = minv[j];
+                    j1 = j;
+                }
+            }
+            for (size_t j = 0; j <= cols; j++) {
+                if (used[j]) {
+                    u[p[j]] += delta;
+                    v[j] -= delta;
+                } else {
+                    minv[j] -= delta;
+                }
+            }
+            j0 = j1;
+        } while (p[j0] != 0);
+        do {
+            auto j1 = way[j0];
+            p[j0] = p[j1];
+            j0 = j1;
+        } while (j0);
+    }
+    std::vector<int> out(rows, -1);
+    for (size_t j = 1; j <= cols; j++) {
+        if (p[j]) {
+            out[p[j] - 1] = (int)(j - 1);
+        }
+    }
+    return out;
+}
+
+}
+
+#endif
@@ -3,9 +3,9 @@
 
 #include <osl/log>
 
+#include <hnsw.hpp>
 #include <geometry.hpp>
 
-#include "opencv2/face.hpp"
 #include <opencv2/dnn.hpp>
 #include <opencv2/aruco.hpp>
 #include <opencv2/bgsegm.hpp>
@@ -13,13 +13,22 @@
 #include <opencv2/core/cuda.hpp>
 #endif
 
+#include <bit>
+#include <array>
+#include <deque>
+#include <mutex>
+#include <atomic>
 #include <string>
 #include <vector>
 #include <chrono>
+#include <future>
+#include <thread>
 #include <fstream>
 #include <sstream>
+#include <shared_mutex>
 #include <filesystem>
 #include <unordered_map>
+#include <condition_variable>
 
 namespace cvl {
 
@@ -82,27 +91,18 @@ struct Detector {
 
     virtual Detections Detect(cv::Mat& frame, spcc cc) = 0;
 
-    // auxiliary detections and filters
-
-    inline static auto detectArucoMarker(cv::Mat& frame) {
-        double cmpp = 0;
-        std::vector<int> markerIds;
-        std::vector<std::vector<cv::Point2f>> allMarkerCorners;
-        std::vector<std::vector<cv::Point2f>> rejectedCandidates;
-        auto markerDictionary = new cv::aruco::Dictionary();
-        *markerDictionary = cv::aruco::getPredefinedDictionary(cv::aruco::DICT_6X6_250);
-        cv::aruco::detectMarkers(frame, cv::Ptr<cv::aruco::Dictionary>(markerDictionary), allMarkerCorners, markerIds);
-        // cv::aruco::drawDetectedMarkers(frame, allMarkerCorners, markerIds, cv::Scalar(0, 0, 255));
-        if (markerIds.size() > 0) {
-            // assume only one marker for now
-            auto edge_distance = geometry::distance<cv::Point2d>(allMarkerCorners[0][0], allMarkerCorners[0][1]);
-            cmpp = marker_length_cm / edge_distance;
-            DBG << "Marker Id : " << markerIds[0];
+    // detectors without a batched path run the frames one at a time
+    virtual std::vector<Detections> DetectBatch(std::vector<cv::Mat>& frames, const std::vector<spcc>& ccs) {
+        std::vector<Detections> out;
+        out.reserve(frames.size());
+        for (size_t i = 0; i < frames.size(); i++) {
+            out.push_back(Detect(frames[i], ccs[i]));
         }
-
-        return cmpp;
+        return out;
     }
 
+    // auxiliary filters
+
     inline static auto FilterDetections(Detections& detections, cv::Mat& m) {
         for (auto&& it = detections.begin(); it != detections.end(); ) {
             auto& roi = *it;
@@ -129,96 +129,270 @@ struct Detector {
     std::string _weightFile;
 };
 
-struct FaceDetector : public Detector {
+// aruco markers for the length stage. the dictionary, detector parameters
+// and the detector itself are built once. with full_every above one the
+// frames in between only search padded regions around the markers seen
+// last, and fall back to a full search when those come up empty
+struct MarkerDetector {
 
-    FaceDetector() : Detector(
-        "FaceDetection/deploy.prototxt",
-        "FaceDetection/res10_300x300_ssd_iter_140000.caffemodel") {}
+    MarkerDetector(int full_every = 1, cv::aruco::PredefinedDictionaryType dictionary = cv::aruco::DICT_6X6_250)
+        : _fullEvery(std::max(full_every, 1)) {
+        _dictionary = cv::aruco::getPredefinedDictionary(dictionary);
+        _detector = cv::aruco::ArucoDetector(_dictionary, _parameters);
+    }
 
-    ~FaceDetector() {}
+    // subpixel corner refinement, off by default as in opencv
+    void refine(int win_size = 5, int max_iterations = 30, double min_accuracy = 0.1) {
+        _parameters.cornerRefinementMethod = cv::aruco::CORNER_REFINE_SUBPIX;
+        _parameters.cornerRefinementWinSize = win_size;
+        _parameters.cornerRefinementMaxIterations = max_iterations;
+        _parameters.cornerRefinementMinAccuracy = min_accuracy;
+        _detector.setDetectorParameters(_parameters);
+    }
+
+    // corners and ids of the markers in the frame, in frame coordinates
+    size_t detect(const cv::Mat& frame) {
+        _ids.clear();
+        _corners.clear();
+        if (frame.empty()) {
+            return 0;
+        }
+        if (_regions.size() && (_frame++ % _fullEvery)) {
+            _roiSearches++;
+            for (const auto& roi : _regions) {
+                _detector.detectMarkers(frame(roi), _roiCorners, _roiIds);
+                for (size_t i = 0; i < _roiIds.size(); i++) {
+                    for (auto& pt : _roiCorners[i]) {
+                        pt += cv::Point2f((float)roi.x, (float)roi.y);
+                    }
+                    _ids.push_back(_roiIds[i]);
+                    _corners.push_back(_roiCorners[i]);
+                }
+            }
+        }
+        if (_ids.empty()) {
+            _frame = 1;
+            _fullSearches++;
+            _detector.detectMarkers(frame, _corners, _ids);
+        }
+        track(frame);
+        return _ids.size();
+    }
+
+    // centimetres per pixel from the first marker found, 0 without one
+    double cmpp(const cv::Mat& frame) {
+        if (!detect(frame)) {
+            return 0;
+        }
+        auto edge_distance = geometry::distance<cv::Point2d>(_corners[0][0], _corners[0][1]);
+        DBG << "Marker Id : " << _ids[0];
+        return edge_distance > 0 ? marker_length_cm / edge_distance : 0;
+    }
+
+    const std::vector<int>& ids(void) const {
+        return _ids;
+    }
+
+    const std::vector<std::vector<cv::Point2f>>& corners(void) const {
+        return _corners;
+    }
+
+    uint64_t fullSearches(void) const {
+        return _fullSearches;
+    }
+
+    uint64_t roiSearches(void) const {
+        return _roiSearches;
+    }
+
+    private:
+
+    int _fullEvery;
+    uint64_t _frame = 0;
+    uint64_t _fullSearches = 0;
+    uint64_t _roiSearches = 0;
+    cv::aruco::Dictionary _dictionary;
+    cv::aruco::DetectorParameters _parameters;
+    cv::aruco::ArucoDetector _detector;
+    std::vector<int> _ids, _roiIds;
+    std::vector<std::vector<cv::Point2f>> _corners, _roiCorners;
+    std::vector<cv::Rect> _regions;
+
+    // the markers padded by half their size (at least 32 pixels), merged
+    // where they overlap
+    void track(const cv::Mat& frame) {
+        _regions.clear();
+        if (_fullEvery == 1) {
+            return;
+        }
+        cv::Rect bounds(0, 0, frame.cols, frame.rows);
+        for (const auto& c : _corners) {
+            auto r = cv::boundingRect(c);
+            auto pad = std::max(32, std::max(r.width, r.height) / 2);
+            r -= cv::Point(pad, pad);
+            r += cv::Size(2 * pad, 2 * pad);
+            r &= bounds;
+            bool merged = false;
+            for (auto& region : _regions) {
+                if ((region & r).area()) {
+                    region |= r;
+                    merged = true;
+                    break;
+                }
+            }
+            if (!merged && r.area()) {
+                _regions.push_back(r);
+            }
+        }
+    }
+};
+
+// caffe ssd networks ending in a DetectionOutput layer. each output row is
+// [image, class, confidence, x1, y1, x2, y2] where image indexes the input
+// batch, so one forward over blobFromImages serves several frames.
+//
+// frames (or roi views of them) are letterboxed straight into reused
+// 300x300 inputs, black bars as makeSquare would add, so a non square view
+// is neither stretched nor padded at full resolution first. the blob is
+// reused between calls as well
+struct SSDDetector : public Detector {
+
+    static constexpr int INPUT_SIZE = 300;
+
+    SSDDetector(const std::string& config, const std::string& weight, double scale, const cv::Scalar& mean)
+        : Detector(config, weight), _scale(scale), _mean(mean) {}
 
     virtual Detections Detect(cv::Mat& frame, spcc cc) override {
-        Detections out;
-        cv::Mat inputBlob = cv::dnn::blobFromImage(
-                        frame,
-                        1.0,
-                        cv::Size(300, 300),
-                        cv::Scalar(104.0, 177.0, 123.0),
+        _inputs.resize(1);
+        letterbox(frame, _inputs[0]);
+        cv::dnn::blobFromImage(
+                        _inputs[0],
+                        _blob,
+                        _scale,
+                        cv::Size(INPUT_SIZE, INPUT_SIZE),
+                        _mean,
+                        false,
+                        false);
+
+        _network.setInput(_blob);
+        std::vector<Detections> out(1);
+        scatter(_network.forward(), &frame, &cc, out);
+        return std::move(out[0]);
+    }
+
+    virtual std::vector<Detections> DetectBatch(std::vector<cv::Mat>& frames, const std::vector<spcc>& ccs) override {
+        std::vector<Detections> out(frames.size());
+        if (frames.empty()) {
+            return out;
+        }
+        _inputs.resize(frames.size());
+        for (size_t i = 0; i < frames.size(); i++) {
+            letterbox(frames[i], _inputs[i]);
+        }
+        cv::dnn::blobFromImages(
+                        _inputs,
+                        _blob,
+                        _scale,
+                        cv::Size(INPUT_SIZE, INPUT_SIZE),
+                        _mean,
                         false,
                         false);
 
-        _network.setInput(inputBlob);
-        cv::Mat detection = _network.forward();
-        cv::Mat detectionMat(detection.size[2], detection.size[3], CV_32F, detection.ptr<float>());
+        _network.setInput(_blob);
+        scatter(_network.forward(), frames.data(), ccs.data(), out);
+        return out;
+    }
+
+    protected:
+
+    double _scale;
+    cv::Scalar _mean;
+    cv::Mat _blob;
+    std::vector<cv::Mat> _inputs;
+
+    // resizes the frame into the centre of input, which keeps its buffer
+    // when it already is INPUT_SIZE square of the frame's type
+    static void letterbox(const cv::Mat& frame, cv::Mat& input) {
+        input.create(INPUT_SIZE, INPUT_SIZE, frame.type());
+        auto side = std::max(frame.cols, frame.rows);
+        auto w = std::max(1, frame.cols * INPUT_SIZE / side);
+        auto h = std::max(1, frame.rows * INPUT_SIZE / side);
+        cv::Rect centre((INPUT_SIZE - w) / 2, (INPUT_SIZE - h) / 2, w, h);
+        if (w != INPUT_SIZE || h != INPUT_SIZE) {
+            input.setTo(cv::Scalar::all(0));
+        }
+        auto view = input(centre);
+        cv::resize(frame, view, centre.size());
+    }
+
+    virtual double threshold(spcc cc) const = 0;
+
+    void scatter(const cv::Mat& detection, const cv::Mat *frames, const spcc *ccs, std::vector<Detections>& out) {
+        cv::Mat detectionMat(detection.size[2], detection.size[3], CV_32F, (void *)detection.ptr<float>());
         for (int i = 0; i < detectionMat.rows; ++i) {
+            // an image without detections yields a row with a negative id
+            auto image = static_cast<int>(detectionMat.at<float>(i, 0));
+            if (image < 0 || image >= (int)out.size()) {
+                continue;
+            }
+            const auto& cc = ccs[image];
+            const auto& frame = frames[image];
             float _confidence = detectionMat.at<float>(i, 2);
-            if (_confidence > (cc->_faceConfidence / 10)) {
-                int x1 = static_cast<int>(detectionMat.at<float>(i, 3) * frame.cols);
-                int y1 = static_cast<int>(detectionMat.at<float>(i, 4) * frame.rows);
-                int x2 = static_cast<int>(detectionMat.at<float>(i, 5) * frame.cols);
-                int y2 = static_cast<int>(detectionMat.at<float>(i, 6) * frame.rows);
+            if (_confidence > threshold(cc)) {
+                // from the letterboxed square back to the frame
+                auto side = std::max(frame.cols, frame.rows);
+                auto dx = (side - frame.cols) / 2, dy = (side - frame.rows) / 2;
+                int x1 = static_cast<int>(detectionMat.at<float>(i, 3) * side) - dx;
+                int y1 = static_cast<int>(detectionMat.at<float>(i, 4) * side) - dy;
+                int x2 = static_cast<int>(detectionMat.at<float>(i, 5) * side) - dx;
+                int y2 = static_cast<int>(detectionMat.at<float>(i, 6) * side) - dy;
 
                 auto rect = cv::Rect2d(x1, y1, x2 - x1, y2 - y1);
 
                 if (cvl::geometry::isRectInsideMat(rect, frame)) {
-                    out.emplace_back(
+                    out[image].emplace_back(
                         cc->_bbIncrement != 0 ?
                             cvl::geometry::resizeRectByWidth(rect,
                                 cc->_bbIncrement) : rect);
                 }
             }
         }
-        return out;
     }
 };
 
-struct ObjectDetector : public Detector {
+struct FaceDetector : public SSDDetector {
 
-    ObjectDetector(const std::string& target) : Detector(
-      "ObjectDetection/MobileNetSSD_deploy.prototxt",
-      "ObjectDetection/MobileNetSSD_deploy.caffemodel"){
-      _target = target;
+    FaceDetector() : SSDDetector(
+        "FaceDetection/deploy.prototxt",
+        "FaceDetection/res10_300x300_ssd_iter_140000.caffemodel",
+        1.0, cv::Scalar(104.0, 177.0, 123.0)) {}
+
+    ~FaceDetector() {}
+
+    protected:
+
+    virtual double threshold(spcc cc) const override {
+        return cc->_faceConfidence / 10;
     }
+};
 
-    virtual Detections Detect(cv::Mat& frame, spcc cc) override {
-        Detections out;
-        cv::Mat inputBlob = cv::dnn::blobFromImage(
-                        frame,
-                        0.007843f,
-                        cv::Size(300, 300),
-                        cv::Scalar(127.5, 127.5, 127.5),
-                        false,
-                        false);
+struct ObjectDetector : public SSDDetector {
 
-        _network.setInput(inputBlob);
-        cv::Mat detection = _network.forward();
-        cv::Mat detectionMat(detection.size[2], detection.size[3], CV_32F, detection.ptr<float>());
-        for (int i = 0; i < detectionMat.rows; ++i) {
-            float _confidence = detectionMat.at<float>(i, 2);
-            if (_confidence > (cc->_objectConfidence / 10)) {
-                int idx, x1, y1, x2, y2;
-                idx = static_cast<int>(detectionMat.at<float>(i, 1));
-                if (1) {//_objectClass[idx] == _target)
-                    x1 = static_cast<int>(detectionMat.at<float>(i, 3) * frame.cols);
-                    y1 = static_cast<int>(detectionMat.at<float>(i, 4) * frame.rows);
-                    x2 = static_cast<int>(detectionMat.at<float>(i, 5) * frame.cols);
-                    y2 = static_cast<int>(detectionMat.at<float>(i, 6) * frame.rows);
-
-                    auto rect = cv::Rect2d(x1, y1, x2 - x1, y2 - y1);
-                    if (cvl::geometry::isRectInsideMat(rect, frame)) {
-                        out.emplace_back(
-                            cc->_bbIncrement != 0 ?
-                                cvl::geometry::resizeRectByWidth(rect,
-                                    cc->_bbIncrement) : rect);
-                    }
-                }
-            }
-        }
-        return out;
+    ObjectDetector(const std::string& target) : SSDDetector(
+      "ObjectDetection/MobileNetSSD_deploy.prototxt",
+      "ObjectDetection/MobileNetSSD_deploy.caffemodel",
+      0.007843f, cv::Scalar(127.5, 127.5, 127.5)) {
+      _target = target;
     }
 
     protected:
 
+    // every class is reported for now, _target is not matched against
+    // _objectClass[idx]
+    virtual double threshold(spcc cc) const override {
+        return cc->_objectConfidence / 10;
+    }
+
     inline static const std::string _objectClass[] = {
       "background", "aeroplane", "bicycle", "bird", "boat",
 	    "bottle", "bus", "car", "cat", "chair", "cow", "diningtable",
@@ -227,67 +401,319 @@ struct ObjectDetector : public Detector {
     };
 };
 
+// shares one detector between threads by gathering their frames into a
+// single DetectBatch, run once the batch is full or the oldest frame has
+// waited for the deadline. Detect blocks its caller until the batch ran
+struct BatchedDetector : public Detector {
+
+    BatchedDetector(std::unique_ptr<Detector> detector, size_t batch, std::chrono::microseconds deadline)
+        : Detector(), _batch(std::max<size_t>(batch, 1)), _deadline(deadline), _detector(std::move(detector)) {
+        _thread = std::thread(&BatchedDetector::run, this);
+    }
+
+    ~BatchedDetector() {
+        {
+            std::lock_guard<std::mutex> lg(_mux);
+            _stop = true;
+        }
+        _cv.notify_all();
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+    }
+
+    virtual Detections Detect(cv::Mat& frame, spcc cc) override {
+        request r{frame, cc, std::chrono::steady_clock::now()};
+        auto result = r._result.get_future();
+        {
+            std::lock_guard<std::mutex> lg(_mux);
+            _pending.push_back(&r);
+        }
+        _cv.notify_all();
+        return result.get();
+    }
+
+    uint64_t batches() const {
+        return _batches;
+    }
+
+    uint64_t frames() const {
+        return _frames;
+    }
+
+    protected:
+
+    struct request {
+        cv::Mat _frame;
+        spcc _cc;
+        std::chrono::steady_clock::time_point _queued;
+        std::promise<Detections> _result;
+    };
+
+    bool _stop = false;
+    size_t _batch;
+    std::mutex _mux;
+    std::thread _thread;
+    std::condition_variable _cv;
+    std::chrono::microseconds _deadline;
+    std::deque<request *> _pending;
+    std::unique_ptr<Detector> _detector;
+    std::atomic<uint64_t> _batches{0};
+    std::atomic<uint64_t> _frames{0};
+
+    void run() {
+        std::unique_lock<std::mutex> ul(_mux);
+        while (true) {
+            _cv.wait(ul, [&](){ return _stop || !_pending.empty(); });
+            if (_pending.empty()) {
+                break;
+            }
+            _cv.wait_until(ul, _pending.front()->_queued + _deadline,
+                [&](){ return _stop || _pending.size() >= _batch; });
+            auto n = std::min(_batch, _pending.size());
+            std::vector<request *> batch(_pending.begin(), _pending.begin() + n);
+            _pending.erase(_pending.begin(), _pending.begin() + n);
+            ul.unlock();
+            std::vector<cv::Mat> frames;
+            std::vector<spcc> ccs;
+            for (auto r : batch) {
+                frames.push_back(r->_frame);
+                ccs.push_back(r->_cc);
+            }
+            auto out = _detector->DetectBatch(frames, ccs);
+            _batches++;
+            _frames += n;
+            for (size_t i = 0; i < n; i++) {
+                batch[i]->_result.set_value(std::move(out[i]));
+            }
+            ul.lock();
+        }
+        DBG << "BatchedDetector thread returning";
+    }
+};
+
+// motion boxes from a bgsegm model (cc->_mocapAlgo: mog, cnt, gmg, gsoc,
+// lsbp). only the selected model is created, on first use, and it starts
+// over when the selection or the frame size changes. the model runs on a
+// grey frame downscaled to cc->_mocapWidth (0 keeps full resolution) with
+// the blur kernel and the _mocapExcludeArea threshold scaled to match, and
+// the boxes are mapped back to the frame. the working buffers are reused
 struct BackgroundSubtractor : public Detector {
 
     BackgroundSubtractor() : Detector() {
-        pBackgroundSubtractor[0] = cv::bgsegm::createBackgroundSubtractorMOG();
-        pBackgroundSubtractor[1] = cv::bgsegm::createBackgroundSubtractorCNT();
-        pBackgroundSubtractor[2] = cv::bgsegm::createBackgroundSubtractorGMG();
-        pBackgroundSubtractor[3] = cv::bgsegm::createBackgroundSubtractorGSOC();
-        pBackgroundSubtractor[4] = cv::bgsegm::createBackgroundSubtractorLSBP();
+        _kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3));
+    }
+
+    static cv::Ptr<cv::BackgroundSubtractor> create(int algo) {
+        switch (algo) {
+            case 0: return cv::bgsegm::createBackgroundSubtractorMOG();
+            case 1: return cv::bgsegm::createBackgroundSubtractorCNT();
+            case 2: return cv::bgsegm::createBackgroundSubtractorGMG();
+            case 4: return cv::bgsegm::createBackgroundSubtractorLSBP();
+            default: return cv::bgsegm::createBackgroundSubtractorGSOC();
+        }
     }
 
     virtual Detections Detect(cv::Mat& frame, spcc cc) override {
-        cv::Mat fgMask;
-        cv::Mat gray, blurred;
-        cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
-        cv::GaussianBlur(gray, blurred, cv::Size(12, 12), 0);
-        pBackgroundSubtractor[cc->_mocapAlgo]->apply(blurred, fgMask, 0.05);
-        cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3));
-        cv::morphologyEx(fgMask, fgMask, cv::MORPH_OPEN, kernel);
-        cv::morphologyEx(fgMask, fgMask, cv::MORPH_CLOSE, kernel);  // optional
-        std::vector<std::vector<cv::Point>> contours;
-        cv::findContours(fgMask, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
         Detections out;
-        double areaThreshold = cc->_mocapExcludeArea;
-        for (size_t i = 0; i < contours.size(); i++) {
-            if (cv::contourArea(contours[i]) < areaThreshold) {
+        if (frame.empty()) {
+            return out;
+        }
+        auto scale = 1.0;
+        if (cc->_mocapWidth > 0 && cc->_mocapWidth < frame.cols) {
+            scale = (double)cc->_mocapWidth / frame.cols;
+        }
+        cv::Size size(std::max(1, (int)std::lround(frame.cols * scale)),
+            std::max(1, (int)std::lround(frame.rows * scale)));
+        if (!_subtractor || _algo != cc->_mocapAlgo || _size != size) {
+            _algo = cc->_mocapAlgo;
+            _size = size;
+            _subtractor = create(_algo);
+            // the 13x13 full resolution blur, scaled and kept odd
+            auto k = std::max(3, (int)std::lround(13 * scale) | 1);
+            _blur = cv::Size(k, k);
+        }
+        if (scale < 1.0) {
+            cv::resize(frame, _small, size, 0, 0, cv::INTER_AREA);
+            cv::cvtColor(_small, _gray, cv::COLOR_BGR2GRAY);
+        } else {
+            cv::cvtColor(frame, _gray, cv::COLOR_BGR2GRAY);
+        }
+        cv::GaussianBlur(_gray, _gray, _blur, 0);
+        _subtractor->apply(_gray, _mask, 0.05);
+        cv::morphologyEx(_mask, _mask, cv::MORPH_OPEN, _kernel);
+        cv::morphologyEx(_mask, _mask, cv::MORPH_CLOSE, _kernel);
+        cv::findContours(_mask, _contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+        double areaThreshold = cc->_mocapExcludeArea * scale * scale;
+        cv::Rect2d bounds(0, 0, frame.cols, frame.rows);
+        for (size_t i = 0; i < _contours.size(); i++) {
+            if (cv::contourArea(_contours[i]) < areaThreshold) {
                 continue;
             }
-            auto bb = cv::boundingRect(contours[i]);
-            out.emplace_back(bb);
+            cv::Rect2d bb = cv::boundingRect(_contours[i]);
+            out.emplace_back(cv::Rect2d(bb.x / scale, bb.y / scale,
+                bb.width / scale, bb.height / scale) & bounds);
         }
         return out;
     }
 
     protected:
 
-    cv::Ptr<cv::BackgroundSubtractor> pBackgroundSubtractor[5] = {nullptr};
+    int _algo = -1;
+    cv::Size _size;
+    cv::Size _blur;
+    cv::Mat _kernel;
+    cv::Mat _small;
+    cv::Mat _gray;
+    cv::Mat _mask;
+    std::vector<std::vector<cv::Point>> _contours;
+    cv::Ptr<cv::BackgroundSubtractor> _subtractor;
 };
 
+// turns a face crop into an l2 normalised vector. openface (nn4.small2,
+// 128 floats) when its torch model is installed, otherwise uniform lbp
+// histograms over a 4x4 grid of the 100x100 gray face, the feature lbph
+// matched on, square rooted so l2 distance behaves like hellinger
+struct FaceEmbedder {
+
+    FaceEmbedder() {
+        auto path = std::getenv("CVL_MODELS_ROOT") + std::string("FaceRecognition/nn4.small2.v1.t7");
+        if (std::filesystem::exists(path)) {
+            try {
+                _net = cv::dnn::readNetFromTorch(path);
+            } catch (const cv::Exception& e) {
+                ERR << "FaceEmbedder " << e.what();
+            }
+        }
+        LOG << "FaceEmbedder using " << name();
+    }
+
+    // stored with the index, vectors of different embedders don't mix
+    std::string name(void) const {
+        return _net.empty() ? "lbp" : "openface";
+    }
+
+    std::vector<float> embed(const cv::Mat& face) {
+        if (face.empty()) {
+            return {};
+        }
+        if (_net.empty()) {
+            return lbp(face);
+        }
+        cv::Mat bgr = face;
+        if (face.channels() == 1) {
+            cv::cvtColor(face, bgr, cv::COLOR_GRAY2BGR);
+        }
+        auto blob = cv::dnn::blobFromImage(bgr, 1.0 / 255, cv::Size(96, 96), cv::Scalar(), true, false);
+        cv::Mat out;
+        {
+            // the net keeps its blobs between setInput and forward
+            std::lock_guard<std::mutex> lg(_mux);
+            _net.setInput(blob);
+            out = _net.forward().clone();
+        }
+        std::vector<float> v(out.ptr<float>(), out.ptr<float>() + out.total());
+        normalize(v);
+        return v;
+    }
+
+    static std::vector<float> lbp(const cv::Mat& face) {
+        // uniform patterns (at most two bit transitions) get a bin each,
+        // the rest share the last one
+        static const auto bins = [](){
+            std::array<uint8_t, 256> t;
+            uint8_t next = 0;
+            for (int i = 0; i < 256; i++) {
+                auto rotated = ((i << 1) | (i >> 7)) & 0xff;
+                t[i] = std::popcount((unsigned)(i ^ rotated)) <= 2 ? next++ : 58;
+            }
+            return t;
+        }();
+        cv::Mat gray;
+        if (face.channels() == 3) {
+            cv::cvtColor(face, gray, cv::COLOR_BGR2GRAY);
+        } else {
+            gray = face;
+        }
+        cv::resize(gray, gray, cv::Size(100, 100));
+        std::vector<float> v(LBP_GRID * LBP_GRID * 59, 0.0f);
+        for (int y = 1; y < gray.rows - 1; y++) {
+            const uchar *up = gray.ptr<uchar>(y - 1);
+            const uchar *row = gray.ptr<uchar>(y);
+            const uchar *down = gray.ptr<uchar>(y + 1);
+            auto cell_row = (y * LBP_GRID / gray.rows) * LBP_GRID;
+            for (int x = 1; x < gray.cols - 1; x++) {
+                auto c = row[x];
+                int code = (up[x - 1] >= c) << 7 | (up[x] >= c) << 6 | (up[x + 1] >= c) << 5 |
+                    (row[x + 1] >= c) << 4 | (down[x + 1] >= c) << 3 | (down[x] >= c) << 2 |
+                    (down[x - 1] >= c) << 1 | (row[x - 1] >= c);
+                v[(cell_row + x * LBP_GRID / gray.cols) * 59 + bins[code]] += 1.0f;
+            }
+        }
+        for (auto& f : v) {
+            f = std::sqrt(f);
+        }
+        normalize(v);
+        return v;
+    }
+
+    private:
+
+    static constexpr int LBP_GRID = 4;
+
+    std::mutex _mux;
+    cv::dnn::Net _net;
+
+    static void normalize(std::vector<float>& v) {
+        double n = 0;
+        for (auto f : v) {
+            n += (double)f * f;
+        }
+        if (n > 0) {
+            auto inv = (float)(1.0 / std::sqrt(n));
+            for (auto& f : v) {
+                f *= inv;
+            }
+        }
+    }
+};
+
+// nearest neighbour recognition over face embeddings in an hnsw index.
+// fr.csv (path;id;tag) stays the list of enrolled images; the index next
+// to it (fr.index) records how many csv lines it holds, so a start only
+// embeds the lines added since, and add() enrols a face without touching
+// the others. predict is safe from many threads, add takes them all out
+// for the length of one insert.
+//
+// confidence is 50 x the l2 distance of the normalised embeddings, 0 to
+// 100 with lower closer, so it spans the settings slider. the default of 50
+// is an l2 of 1, about where openface tells people apart. lbp histograms
+// are never negative and stay under 71, they want a lower threshold
 struct FaceRecognizer {
 
-    FaceRecognizer(const std::string& csv) {
+    FaceRecognizer(const std::string& csv) : _csv(csv) {
+        _path = (std::filesystem::path(csv).parent_path() / "fr.index").string();
         _id_tag_map.reserve(256);
+        if (!load()) {
+            _lines = 0;
+            _id_tag_map.clear();
+            _index = cvl::hnsw_index();
+        }
         try {
-            read_csv(csv);
+            if (read_csv(csv)) {
+                save();
+            }
         } catch (const std::exception& e) {
             std::cerr << e.what() << std::endl;
         }
-        _model = cv::face::LBPHFaceRecognizer::create();
-        _model->setGridX(4);
-        _model->setGridY(4);
-        _model->setRadius(1);
-        _model->setNeighbors(8);
-        if (_images.size() && _ids.size()) {
-            _model->train(_images, _ids);
-        }
+        LOG << "FaceRecognizer " << _index.size() << " faces of " << _id_tag_map.size() << " tags";
     }
 
     ~FaceRecognizer() = default;
 
     auto getTagFromId(int id) {
         std::string tag;
+        std::shared_lock<std::shared_mutex> sl(_mux);
         try {
             tag = _id_tag_map.at(id);
         } catch(const std::exception& e) {
@@ -297,56 +723,188 @@ struct FaceRecognizer {
     }
 
     auto predict(const cv::Mat& mat, spcc cc) {
-        int id = -1;
-        cv::Mat gray;
-        cv::cvtColor(mat, gray, cv::COLOR_BGR2GRAY);
-        cv::resize(gray, gray, cv::Size(100, 100));
-        double confidence = 0.0;
-        _model->predict(gray, id, confidence);
         std::pair<int, double> pair = {-1, 0.0};
-        if (confidence <= cc->_facerecConfidence) {
-            pair = std::make_pair(id, confidence);
+        auto v = _embedder.embed(mat);
+        if (v.empty()) {
+            return pair;
+        }
+        std::shared_lock<std::shared_mutex> sl(_mux);
+        if (_index.dim() != v.size()) {
+            return pair;
+        }
+        auto found = _index.search(v.data(), 1);
+        if (found.size()) {
+            double confidence = 50.0 * std::sqrt(found[0].first);
+            if (confidence <= cc->_facerecConfidence) {
+                pair = std::make_pair(found[0].second, confidence);
+            }
         }
         return pair;
     }
 
+    // enrols the image and appends it to the csv. call save() after a batch.
+    // the line and the index entry go in under one lock, so the csv and the
+    // count of lines the index holds never disagree
+    bool add(const std::string& path, int id, const std::string& tag) {
+        auto img = cv::imread(path, cv::IMREAD_COLOR);
+        if (img.empty()) {
+            ERR << "FaceRecognizer could not load image: " << path;
+            return false;
+        }
+        auto v = _embedder.embed(img);
+        std::unique_lock<std::shared_mutex> ul(_mux);
+        std::ofstream csv(_csv, std::ios::app);
+        if (!csv || !(csv << path << ';' << id << ';' << tag << '\n').flush()) {
+            ERR << "FaceRecognizer could not append to " << _csv;
+            return false;
+        }
+        _lines++;
+        enroll(v, id, tag);
+        return true;
+    }
+
+    // written to a temporary and renamed over, a crash keeps the old index
+    bool save(void) {
+        auto tmp = _path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                ERR << "FaceRecognizer could not write " << tmp;
+                return false;
+            }
+            std::shared_lock<std::shared_mutex> sl(_mux);
+            auto name = _embedder.name();
+            uint64_t header[] = {INDEX_MAGIC, name.size(), _lines, _id_tag_map.size()};
+            out.write((const char *)header, sizeof(header));
+            out.write(name.data(), name.size());
+            for (const auto& [id, tag] : _id_tag_map) {
+                uint64_t entry[] = {(uint64_t)(int64_t)id, tag.size()};
+                out.write((const char *)entry, sizeof(entry));
+                out.write(tag.data(), tag.size());
+            }
+            if (!_index.save(out)) {
+                ERR << "FaceRecognizer could not write " << tmp;
+                return false;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, _path, ec);
+        if (ec) {
+            ERR << "FaceRecognizer " << ec.message();
+            return false;
+        }
+        return true;
+    }
+
+    size_t size(void) {
+        std::shared_lock<std::shared_mutex> sl(_mux);
+        return _index.size();
+    }
+
     private:
 
-    std::vector<int> _ids;
-    std::vector<cv::Mat> _images;
-    std::vector<std::string> _tags;
-    cv::Ptr<cv::face::LBPHFaceRecognizer> _model;
+    static constexpr uint64_t INDEX_MAGIC = 0x3158444e49524643; // "CFRINDX1"
+
+    std::string _csv;
+    std::string _path;
+    uint64_t _lines = 0;
+    std::shared_mutex _mux;
+    cvl::hnsw_index _index;
+    cvl::FaceEmbedder _embedder;
     std::unordered_map<int, std::string> _id_tag_map;
 
-    void read_csv(const std::string& filename, char separator = ';') {
+    // with _mux held exclusively
+    void enroll(const std::vector<float>& v, int id, const std::string& tag) {
+        if (v.empty()) {
+            return;
+        }
+        if (!_index.size() && _index.dim() != v.size()) {
+            _index = cvl::hnsw_index(v.size());
+        }
+        if (_index.dim() != v.size()) {
+            return;
+        }
+        _index.add(id, v.data());
+        _id_tag_map[id] = tag;
+    }
+
+    bool load(void) {
+        std::ifstream in(_path, std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        uint64_t header[4] = {};
+        in.read((char *)header, sizeof(header));
+        if (!in || header[0] != INDEX_MAGIC || header[1] > 64) {
+            ERR << "FaceRecognizer ignoring " << _path;
+            return false;
+        }
+        std::string name(header[1], '\0');
+        in.read(name.data(), name.size());
+        if (name != _embedder.name()) {
+            LOG << "FaceRecognizer " << _path << " holds " << name << " embeddings, re-enrolling";
+            return false;
+        }
+        _lines = header[2];
+        for (uint64_t i = 0; i < header[3] && in; i++) {
+            uint64_t entry[2] = {};
+            in.read((char *)entry, sizeof(entry));
+            if (entry[1] > 4096) {
+                return false;
+            }
+            std::string tag(entry[1], '\0');
+            in.read(tag.data(), tag.size());
+            _id_tag_map[(int)(int64_t)entry[0]] = tag;
+        }
+        if (!in || !_index.load(in)) {
+            ERR << "FaceRecognizer ignoring " << _path;
+            return false;
+        }
+        return true;
+    }
+
+    // embeds the csv lines past the ones already in the index, starts over
+    // when the csv got shorter. returns true if anything was added
+    bool read_csv(const std::string& filename, char separator = ';') {
         std::ifstream file(filename.c_str(), std::ifstream::in);
         if (!file) {
             ERR << "read_csv Invalid input file";
-            return;
+            return false;
         }
+        std::vector<std::string> lines;
         std::string line, path, id, tag;
         while (getline(file, line)) {
-            std::stringstream liness(line);
+            lines.push_back(line);
+        }
+        if (lines.size() < _lines) {
+            LOG << "read_csv " << filename << " shrank, re-enrolling";
+            _lines = 0;
+            _id_tag_map.clear();
+            _index = cvl::hnsw_index();
+        }
+        if (lines.size() == _lines) {
+            return false;
+        }
+        for (size_t i = _lines; i < lines.size(); i++) {
+            std::stringstream liness(lines[i]);
             std::getline(liness, path, separator);
             std::getline(liness, id, separator);
             std::getline(liness, tag);
             if(!path.empty() && !id.empty() && !tag.empty()) {
-                auto img = cv::imread(path, cv::IMREAD_GRAYSCALE);
+                auto img = cv::imread(path, cv::IMREAD_COLOR);
                 if (img.empty()) {
                     std::cout << "Warning: Could not load image: " << path << std::endl;
                     continue;
                 }
-                cv::resize(img, img, cv::Size(100, 100));
-                _images.push_back(img);
-                _tags.push_back(tag);
-                auto i = std::atoi(id.c_str());
-                _ids.push_back(i);
-                _id_tag_map.emplace(i, tag);
+                auto v = _embedder.embed(img);
+                std::unique_lock<std::shared_mutex> ul(_mux);
+                enroll(v, std::atoi(id.c_str()), tag);
             }
         }
+        _lines = lines.size();
+        return true;
     }
 };
-
 }
 
 #endif
\ No newline at end of file
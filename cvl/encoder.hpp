@@ -0,0 +1,202 @@
+#ifndef ENCODER_HPP
+#define ENCODER_HPP
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <algorithm>
+#include <condition_variable>
+
+#include <profiler.hpp>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+namespace cvl {
+
+// what gives when snapshots arrive faster than they can be written
+enum class drop_policy : uint8_t {
+    drop_oldest,
+    drop_newest,
+    block
+};
+
+struct encoder_stats {
+    uint64_t submitted = 0;
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+    uint64_t failed = 0;
+    uint64_t bytes = 0;
+    uint64_t batches = 0;
+    size_t queued = 0;
+    size_t peak_queued = 0;
+};
+
+// jpeg encodes detection snapshots away from the pipeline threads. a bounded
+// queue feeds a few encoder threads, each takes up to batch snapshots at a
+// time, encodes them into buffers it keeps between batches and then writes
+// the batch out. a full queue applies the drop policy
+struct encoder_pool {
+
+    encoder_pool(size_t threads = 2, size_t capacity = 64, size_t batch = 8,
+            int quality = 90, drop_policy policy = drop_policy::drop_oldest)
+            : _capacity(std::max<size_t>(capacity, 1)), _batch(std::max<size_t>(batch, 1)),
+              _policy(policy), _quality(quality), _profile(profiler::shared().process()) {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+            _threads.emplace_back(&encoder_pool::run, this);
+        }
+    }
+
+    // drains what is queued before returning
+    ~encoder_pool() {
+        {
+            std::lock_guard<std::mutex> lg(_mux);
+            _stop = true;
+        }
+        _cv.notify_all();
+        _room.notify_all();
+        for (auto& t : _threads) {
+            t.join();
+        }
+    }
+
+    // one pool for all pipelines of the process
+    static std::shared_ptr<encoder_pool> shared() {
+        static auto pool = std::make_shared<encoder_pool>();
+        return pool;
+    }
+
+    // path is without the extension. returns false if this or an older
+    // snapshot had to be dropped
+    bool submit(cv::Mat&& mat, std::string path) {
+        bool dropped = false;
+        std::unique_lock<std::mutex> ul(_mux);
+        _stats.submitted++;
+        if (_queue.size() >= _capacity) {
+            switch (_policy) {
+                case drop_policy::drop_newest:
+                    _stats.dropped++;
+                    _profile->set(gauge::snapshots_dropped, (int64_t)_stats.dropped);
+                    return false;
+                case drop_policy::drop_oldest:
+                    _queue.pop_front();
+                    _stats.dropped++;
+                    _profile->set(gauge::snapshots_dropped, (int64_t)_stats.dropped);
+                    dropped = true;
+                    break;
+                case drop_policy::block:
+                    _room.wait(ul, [&](){ return _stop || _queue.size() < _capacity; });
+                    break;
+            }
+        }
+        _queue.push_back({std::move(mat), std::move(path)});
+        _stats.peak_queued = std::max(_stats.peak_queued, _queue.size());
+        ul.unlock();
+        _cv.notify_one();
+        return !dropped;
+    }
+
+    // waits until everything submitted so far has been written
+    void flush(void) {
+        std::unique_lock<std::mutex> ul(_mux);
+        _idle.wait(ul, [&](){ return _queue.empty() && !_busy; });
+    }
+
+    void quality(int q) {
+        _quality = q;
+    }
+
+    encoder_stats stats(void) {
+        std::lock_guard<std::mutex> lg(_mux);
+        auto s = _stats;
+        s.queued = _queue.size();
+        return s;
+    }
+
+    private:
+
+    struct snapshot {
+        cv::Mat _mat;
+        std::string _path;
+    };
+
+    bool _stop = false;
+    int _busy = 0;
+    size_t _capacity;
+    size_t _batch;
+    drop_policy _policy;
+    std::atomic<int> _quality;
+    std::shared_ptr<profile> _profile;
+    std::mutex _mux;
+    std::condition_variable _cv;
+    std::condition_variable _room;
+    std::condition_variable _idle;
+    encoder_stats _stats;
+    std::deque<snapshot> _queue;
+    std::vector<std::thread> _threads;
+
+    void run() {
+        std::vector<snapshot> batch;
+        std::vector<std::vector<uchar>> buffers;
+        std::unique_lock<std::mutex> ul(_mux);
+        while (true) {
+            _cv.wait(ul, [&](){ return _stop || !_queue.empty(); });
+            if (_queue.empty()) {
+                break;
+            }
+            auto n = std::min(_batch, _queue.size());
+            batch.clear();
+            for (size_t i = 0; i < n; i++) {
+                batch.push_back(std::move(_queue.front()));
+                _queue.pop_front();
+            }
+            _busy++;
+            ul.unlock();
+            _room.notify_all();
+            if (buffers.size() < n) {
+                buffers.resize(n);
+            }
+            std::vector<int> params = {cv::IMWRITE_JPEG_QUALITY, _quality.load()};
+            for (size_t i = 0; i < n; i++) {
+                scoped_timer t(_profile.get(), stage::encode);
+                buffers[i].clear();
+                if (!cv::imencode(".jpg", batch[i]._mat, buffers[i], params)) {
+                    buffers[i].clear();
+                }
+                // the pixels are not needed for the write
+                batch[i]._mat.release();
+            }
+            uint64_t written = 0, bytes = 0;
+            for (size_t i = 0; i < n; i++) {
+                if (buffers[i].empty()) {
+                    continue;
+                }
+                std::ofstream fout(batch[i]._path + ".jpg", std::ios::out | std::ios::binary);
+                fout.write((const char *)buffers[i].data(), buffers[i].size());
+                if (fout) {
+                    written++;
+                    bytes += buffers[i].size();
+                }
+            }
+            ul.lock();
+            _busy--;
+            _stats.batches++;
+            _stats.bytes += bytes;
+            _stats.written += written;
+            _stats.failed += n - written;
+            if (_queue.empty() && !_busy) {
+                _idle.notify_all();
+            }
+        }
+    }
+};
+
+}
+
+#endif
@@ -14,11 +14,13 @@ struct cam_config {
     int _stages;
     int _mocapAlgo;
     int _skipFrames;
+    int _mocapWidth;
     int _bbIncrement;
     int _bbThickness;
     std::string _name;
     std::string _source;
     int _waitKeyTimeout;
+    int _detectInterval;
     std::string _chatids;
     std::string _botToken;
     double _faceConfidence;
@@ -137,19 +139,25 @@ inline auto computeLaplacianVariance(const cv::Mat& img) {
     return variance;
 }
 
-inline auto makeSquare(const cv::Mat& input, const cv::Scalar& paddingColor = cv::Scalar(0, 0, 0)) {
+// pads input to a square centered in square, which is reused when it
+// already has the right size and type (e.g. a pooled frame buffer)
+inline void makeSquare(const cv::Mat& input, cv::Mat& square, const cv::Scalar& paddingColor = cv::Scalar(0, 0, 0)) {
     int width = input.cols;
     int height = input.rows;
     int maxDim = std::max(width, height);
-    // Create a square black image
-    cv::Mat square = cv::Mat::zeros(cv::Size(maxDim, maxDim), input.type());
-    square.setTo(paddingColor);
     // Compute top-left corner where the image will be placed
     int xOffset = (maxDim - width) / 2;
     int yOffset = (maxDim - height) / 2;
-    // Define ROI and copy input frame into the center
-    cv::Rect roi(xOffset, yOffset, width, height);
-    input.copyTo(square(roi));
+    // only the borders are filled, the frame is copied once into the center
+    cv::copyMakeBorder(input, square,
+        yOffset, maxDim - height - yOffset,
+        xOffset, maxDim - width - xOffset,
+        cv::BORDER_CONSTANT, paddingColor);
+}
+
+inline auto makeSquare(const cv::Mat& input, const cv::Scalar& paddingColor = cv::Scalar(0, 0, 0)) {
+    cv::Mat square;
+    makeSquare(input, square, paddingColor);
     return square;
 }
 
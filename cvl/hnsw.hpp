@@ -0,0 +1,337 @@
+#ifndef HNSW_HPP
+#define HNSW_HPP
+
+#include <cmath>
+#include <queue>
+#include <random>
+#include <vector>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <utility>
+#include <algorithm>
+
+namespace cvl {
+
+// hierarchical navigable small world graph (malkov & yashunin) over fixed
+// length float vectors with squared l2 distance. vectors are added one at a
+// time, there is no rebuild, and several vectors may share a label. not
+// synchronised: callers serialise add() against search()
+struct hnsw_index {
+
+    hnsw_index(size_t dim = 0, size_t m = 16, size_t ef_construction = 200)
+        : _dim(dim), _m(std::max<size_t>(m, 2)), _ef_construction(ef_construction),
+          _ml(1.0 / std::log((double)_m)) {}
+
+    size_t dim(void) const {
+        return _dim;
+    }
+
+    size_t size(void) const {
+        return _labels.size();
+    }
+
+    void add(int label, const float *v) {
+        auto id = (uint32_t)_labels.size();
+        auto level = (int)(-std::log(std::max(_uniform(_rng), 1e-12)) * _ml);
+        _labels.push_back(label);
+        _data.insert(_data.end(), v, v + _dim);
+        _links.emplace_back(level + 1);
+        if (_entry < 0) {
+            _entry = (int)id;
+            _top = level;
+            return;
+        }
+        auto cur = (uint32_t)_entry;
+        for (int l = _top; l > level; l--) {
+            cur = greedy(v, cur, l);
+        }
+        for (int l = std::min(level, _top); l >= 0; l--) {
+            auto candidates = search_layer(v, cur, _ef_construction, l);
+            auto neighbours = select(candidates, _m);
+            _links[id][l] = neighbours;
+            for (auto n : neighbours) {
+                auto& links = _links[n][l];
+                links.push_back(id);
+                if (links.size() > max_links(l)) {
+                    shrink(n, l);
+                }
+            }
+            cur = candidates.front().second;
+        }
+        if (level > _top) {
+            _top = level;
+            _entry = (int)id;
+        }
+    }
+
+    // the k nearest vectors as (distance, label), closest first
+    std::vector<std::pair<float, int>> search(const float *q, size_t k, size_t ef = 64) const {
+        std::vector<std::pair<float, int>> out;
+        if (_entry < 0 || !k) {
+            return out;
+        }
+        auto cur = (uint32_t)_entry;
+        for (int l = _top; l > 0; l--) {
+            cur = greedy(q, cur, l);
+        }
+        auto found = search_layer(q, cur, std::max(ef, k), 0);
+        for (size_t i = 0; i < found.size() && i < k; i++) {
+            out.emplace_back(found[i].first, _labels[found[i].second]);
+        }
+        return out;
+    }
+
+    // exhaustive search, the reference for recall
+    std::vector<std::pair<float, int>> search_exact(const float *q, size_t k) const {
+        std::vector<std::pair<float, uint32_t>> all;
+        for (uint32_t i = 0; i < _labels.size(); i++) {
+            all.emplace_back(distance(q, vector(i)), i);
+        }
+        k = std::min(k, all.size());
+        std::partial_sort(all.begin(), all.begin() + k, all.end());
+        std::vector<std::pair<float, int>> out;
+        for (size_t i = 0; i < k; i++) {
+            out.emplace_back(all[i].first, _labels[all[i].second]);
+        }
+        return out;
+    }
+
+    bool save(std::ostream& os) const {
+        uint64_t header[] = {_dim, _m, _ef_construction, _labels.size(), (uint64_t)(int64_t)_entry, (uint64_t)(int64_t)_top};
+        os.write((const char *)header, sizeof(header));
+        os.write((const char *)_labels.data(), _labels.size() * sizeof(int));
+        os.write((const char *)_data.data(), _data.size() * sizeof(float));
+        for (const auto& node : _links) {
+            uint32_t levels = (uint32_t)node.size();
+            os.write((const char *)&levels, sizeof(levels));
+            for (const auto& links : node) {
+                uint32_t count = (uint32_t)links.size();
+                os.write((const char *)&count, sizeof(count));
+                os.write((const char *)links.data(), count * sizeof(uint32_t));
+            }
+        }
+        return (bool)os;
+    }
+
+    // false on a file that is not an index this could have saved, which then
+    // is left empty. every count is checked against what the stream holds
+    // and every id and level against the graph before any search walks it
+    bool load(std::istream& is) {
+        if (!read(is) || !valid()) {
+            *this = hnsw_index();
+            return false;
+        }
+        return true;
+    }
+
+    private:
+
+    using candidate = std::pair<float, uint32_t>;
+
+    static constexpr uint64_t MAX_DIM = 1 << 16;
+    static constexpr uint64_t MAX_M = 1 << 10;
+    static constexpr int64_t MAX_LEVELS = 64;
+
+    size_t _dim;
+    size_t _m;
+    size_t _ef_construction;
+    double _ml;
+    int _entry = -1;
+    int _top = -1;
+    std::vector<int> _labels;
+    std::vector<float> _data;
+    // per node, per level, the ids of its neighbours
+    std::vector<std::vector<std::vector<uint32_t>>> _links;
+    std::mt19937 _rng{0x5eed};
+    std::uniform_real_distribution<double> _uniform{0.0, 1.0};
+
+    bool read(std::istream& is) {
+        uint64_t header[6] = {};
+        auto start = is.tellg();
+        if (start < 0 || !is.seekg(0, std::ios::end)) {
+            return false;
+        }
+        auto left = (uint64_t)(is.tellg() - start);
+        if (!is.seekg(start).read((char *)header, sizeof(header))) {
+            return false;
+        }
+        left -= sizeof(header);
+        auto nodes = header[3];
+        auto entry = (int64_t)header[4];
+        auto top = (int64_t)header[5];
+        // a node is at least its label, its vector and its level count
+        if (!header[0] || header[0] > MAX_DIM || header[1] < 2 || header[1] > MAX_M ||
+                nodes > left / (sizeof(int) + header[0] * sizeof(float) + sizeof(uint32_t)) ||
+                (nodes ? (entry < 0 || entry >= (int64_t)nodes || top < 0 || top >= MAX_LEVELS) : (entry != -1 || top != -1))) {
+            return false;
+        }
+        *this = hnsw_index(header[0], header[1], header[2]);
+        _entry = (int)entry;
+        _top = (int)top;
+        _labels.resize(nodes);
+        _data.resize(nodes * _dim);
+        _links.resize(nodes);
+        is.read((char *)_labels.data(), _labels.size() * sizeof(int));
+        is.read((char *)_data.data(), _data.size() * sizeof(float));
+        for (auto& node : _links) {
+            uint32_t levels = 0;
+            is.read((char *)&levels, sizeof(levels));
+            if (!is || !levels || levels > MAX_LEVELS) {
+                return false;
+            }
+            node.resize(levels);
+            for (auto& links : node) {
+                uint32_t count = 0;
+                is.read((char *)&count, sizeof(count));
+                if (!is || count > 2 * _m + 1) {
+                    return false;
+                }
+                links.resize(count);
+                is.read((char *)links.data(), count * sizeof(uint32_t));
+            }
+        }
+        return (bool)is;
+    }
+
+    // every link names a node on the link's level, the entry is on the top
+    bool valid(void) const {
+        if (_entry >= 0 && _links[_entry].size() != (size_t)_top + 1) {
+            return false;
+        }
+        for (const auto& node : _links) {
+            for (size_t l = 0; l < node.size(); l++) {
+                for (auto n : node[l]) {
+                    if (n >= _links.size() || _links[n].size() <= l) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    size_t max_links(int level) const {
+        return level ? _m : 2 * _m;
+    }
+
+    const float *vector(uint32_t id) const {
+        return _data.data() + (size_t)id * _dim;
+    }
+
+    // four partial sums so the compiler can vectorise without fast math
+    float distance(const float *a, const float *b) const {
+        float d[4] = {};
+        size_t i = 0;
+        for (; i + 4 <= _dim; i += 4) {
+            for (size_t j = 0; j < 4; j++) {
+                auto t = a[i + j] - b[i + j];
+                d[j] += t * t;
+            }
+        }
+        for (; i < _dim; i++) {
+            auto t = a[i] - b[i];
+            d[0] += t * t;
+        }
+        return (d[0] + d[1]) + (d[2] + d[3]);
+    }
+
+    uint32_t greedy(const float *q, uint32_t cur, int level) const {
+        auto best = distance(q, vector(cur));
+        for (bool moved = true; moved; ) {
+            moved = false;
+            for (auto n : _links[cur][level]) {
+                auto d = distance(q, vector(n));
+                if (d < best) {
+                    best = d;
+                    cur = n;
+                    moved = true;
+                }
+            }
+        }
+        return cur;
+    }
+
+    // the ef closest nodes reachable on one level, closest first
+    std::vector<candidate> search_layer(const float *q, uint32_t entry, size_t ef, int level) const {
+        // visited marks are reused between searches on the same thread
+        thread_local std::vector<uint32_t> visited;
+        thread_local uint32_t stamp = 0;
+        if (visited.size() < _labels.size()) {
+            visited.resize(_labels.size(), 0);
+        }
+        if (++stamp == 0) {
+            std::fill(visited.begin(), visited.end(), 0);
+            stamp = 1;
+        }
+        std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate>> frontier;
+        std::priority_queue<candidate> nearest;
+        auto d = distance(q, vector(entry));
+        frontier.emplace(d, entry);
+        nearest.emplace(d, entry);
+        visited[entry] = stamp;
+        while (!frontier.empty()) {
+            auto [cd, c] = frontier.top();
+            if (cd > nearest.top().first && nearest.size() >= ef) {
+                break;
+            }
+            frontier.pop();
+            for (auto n : _links[c][level]) {
+                if (visited[n] == stamp) {
+                    continue;
+                }
+                visited[n] = stamp;
+                auto nd = distance(q, vector(n));
+                if (nearest.size() < ef || nd < nearest.top().first) {
+                    frontier.emplace(nd, n);
+                    nearest.emplace(nd, n);
+                    if (nearest.size() > ef) {
+                        nearest.pop();
+                    }
+                }
+            }
+        }
+        std::vector<candidate> out(nearest.size());
+        for (auto i = out.size(); i > 0; i--) {
+            out[i - 1] = nearest.top();
+            nearest.pop();
+        }
+        return out;
+    }
+
+    // neighbour selection heuristic: keep a candidate only if it is closer
+    // to the new node than to any neighbour already kept, which preserves
+    // links across clusters. candidates are sorted closest first
+    std::vector<uint32_t> select(const std::vector<candidate>& candidates, size_t m) const {
+        std::vector<uint32_t> out;
+        for (const auto& [d, c] : candidates) {
+            if (out.size() >= m) {
+                break;
+            }
+            bool keep = true;
+            for (auto o : out) {
+                if (distance(vector(c), vector(o)) < d) {
+                    keep = false;
+                    break;
+                }
+            }
+            if (keep) {
+                out.push_back(c);
+            }
+        }
+        return out;
+    }
+
+    void shrink(uint32_t node, int level) {
+        std::vector<candidate> candidates;
+        for (auto n : _links[node][level]) {
+            candidates.emplace_back(distance(vector(node), vector(n)), n);
+        }
+        std::sort(candidates.begin(), candidates.end());
+        _links[node][level] = select(candidates, max_links(level));
+    }
+};
+
+}
+
+#endif
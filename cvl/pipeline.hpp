@@ -5,7 +5,9 @@
 #include <chrono>
 #include <fstream>
 
+#include <encoder.hpp>
 #include <geometry.hpp>
+#include <profiler.hpp>
 #include <detector.hpp>
 #include <tracker.hpp>
 
@@ -13,23 +15,59 @@
 
 namespace cvl {
 
+// cam_config::_flags bit that turns on the motion gated cascade
+constexpr int CASCADE_FLAG = 16;
+// padding added around a motion box (fraction of its larger side, and at
+// least half the minimum) before it is cropped for the dnn stages
+constexpr double CASCADE_ROI_PADDING = 0.25;
+constexpr int CASCADE_ROI_MIN = 96;
+// the length stage searches the whole frame for its marker every this many
+// frames and only around the last one in between
+constexpr int MARKER_FULL_SEARCH_INTERVAL = 10;
+
+// the networks a pipeline runs. cv::dnn::Net keeps its blobs between
+// setInput and forward, so a model_set must only be used by one thread
+// at a time unless its detectors are shareable (BatchedDetector)
+struct model_set {
+    model_set() {
+        _faceDetector = std::make_shared<cvl::FaceDetector>();
+        _objectDetector = std::make_shared<cvl::ObjectDetector>("person");
+    }
+    model_set(std::shared_ptr<cvl::Detector> face, std::shared_ptr<cvl::Detector> object) {
+        _faceDetector = face;
+        _objectDetector = object;
+    }
+    std::shared_ptr<cvl::Detector> _faceDetector = nullptr;
+    std::shared_ptr<cvl::Detector> _objectDetector = nullptr;
+};
+
+// one recognizer serves every camera of the process, so a face enrolled
+// from the ui is recognised by all of them without a reload
+inline auto make_face_recognizer() {
+    static auto recognizer = std::make_shared<cvl::FaceRecognizer>(
+        std::getenv("CVL_MODELS_ROOT") + std::string("FaceRecognition/fr.csv"));
+    return recognizer;
+}
+
 struct pipeline {
 
-    pipeline() {
+    pipeline() : pipeline(std::make_shared<model_set>(), make_face_recognizer()) {}
+
+    // models may be null when the caller always passes its own to execute()
+    pipeline(std::shared_ptr<model_set> models, std::shared_ptr<cvl::FaceRecognizer> recognizer) {
+        _models = models;
+        _faceRecognizer = recognizer;
+        _encoder = cvl::encoder_pool::shared();
         _tracker = std::make_unique<cvl::Tracker>();
-        _faceDetector = std::make_unique<cvl::FaceDetector>();
-        _thread = std::thread(&pipeline::detectionSaveThread, this);
-        _objectDetector = std::make_unique<cvl::ObjectDetector>("person");
+        _markerDetector = std::make_unique<cvl::MarkerDetector>(MARKER_FULL_SEARCH_INTERVAL);
         _backgroundSubtractor = std::make_unique<cvl::BackgroundSubtractor>();
-        _faceRecognizer = std::make_unique<cvl::FaceRecognizer>(
-            std::getenv("CVL_MODELS_ROOT") + std::string("FaceRecognition/fr.csv"));
     }
 
-    ~pipeline() {
-        _stop = true;
-        if (_thread.joinable()) {
-            _thread.join();
-        }
+    ~pipeline() {}
+
+    // stage timings go to this profile, none are taken while it is null
+    void set_profile(std::shared_ptr<cvl::profile> profile) {
+        _profile = profile;
     }
 
     inline auto filterRightAngleContours(const cv::Mat& frame) {
@@ -61,17 +99,103 @@ struct pipeline {
 
     inline auto detectMotion(cv::Mat& frame, spcc cc) {
         auto bbs = _backgroundSubtractor->Detect(frame, cc);
+        drawMotion(frame, bbs);
+        return bbs;
+    }
+
+    inline void drawMotion(cv::Mat& frame, const Detections& bbs) {
         for (const auto& bb : bbs) {
             cv::rectangle(frame, bb, cv::Scalar(0, 255, 0), 1);
             cv::putText(frame, std::to_string((int)(bb.width * bb.height)),
                 cv::Point((int)bb.x, (int)(bb.y - 5)), cv::FONT_HERSHEY_SIMPLEX,
                     0.5, cv::Scalar(0, 0, 255), 1);
         }
-        return bbs;
+    }
+
+    // motion boxes padded and merged into the regions the dnn stages look
+    // at. falls back to the whole frame once the regions cover half of it
+    inline auto cascadeRegions(const Detections& motion, const cv::Mat& frame) {
+        std::vector<cv::Rect> rois;
+        cv::Rect bounds(0, 0, frame.cols, frame.rows);
+        for (const auto& bb : motion) {
+            auto roi = static_cast<cv::Rect>(bb);
+            auto pad = std::max((int)(std::max(roi.width, roi.height) * CASCADE_ROI_PADDING),
+                CASCADE_ROI_MIN / 2);
+            roi -= cv::Point(pad, pad);
+            roi += cv::Size(2 * pad, 2 * pad);
+            roi &= bounds;
+            if (roi.area()) {
+                rois.push_back(roi);
+            }
+        }
+        for (bool merged = true; merged; ) {
+            merged = false;
+            for (size_t i = 0; i < rois.size() && !merged; i++) {
+                for (size_t j = i + 1; j < rois.size(); j++) {
+                    if ((rois[i] & rois[j]).area()) {
+                        rois[i] |= rois[j];
+                        rois.erase(rois.begin() + j);
+                        merged = true;
+                        break;
+                    }
+                }
+            }
+        }
+        int area = 0;
+        for (const auto& roi : rois) {
+            area += roi.area();
+        }
+        if (area * 2 > bounds.area()) {
+            rois.assign(1, bounds);
+        }
+        return rois;
+    }
+
+    // runs a detector over views of the frame (no copies, one batch) and
+    // maps what it found back to frame coordinates
+    inline auto detectInRegions(cvl::Detector& detector, cv::Mat& frame, const std::vector<cv::Rect>& rois, spcc cc) {
+        Detections out;
+        std::vector<cv::Mat> crops;
+        std::vector<spcc> ccs(rois.size(), cc);
+        for (const auto& roi : rois) {
+            crops.push_back(frame(roi));
+        }
+        auto found = detector.DetectBatch(crops, ccs);
+        for (size_t i = 0; i < found.size(); i++) {
+            for (const auto& bb : found[i]) {
+                out.emplace_back(bb.x + rois[i].x, bb.y + rois[i].y, bb.width, bb.height);
+            }
+        }
+        return out;
+    }
+
+    // motion gates the dnn stages and narrows them to the moving regions.
+    // unlike the full frame path the face and object results add up
+    inline void detectCascade(cv::Mat& frame, spcc cc, model_set& models, Detections& faces, Detections& objects) {
+        auto p = _profile.get();
+        Detections motion;
+        {
+            cvl::scoped_timer t(p, cvl::stage::motion);
+            motion = _backgroundSubtractor->Detect(frame, cc);
+        }
+        if (motion.size()) {
+            auto rois = cascadeRegions(motion, frame);
+            if (cc->_stages & 1) {
+                cvl::scoped_timer t(p, cvl::stage::face);
+                faces = detectInRegions(*models._faceDetector, frame, rois, cc);
+            }
+            if (cc->_stages & 2) {
+                cvl::scoped_timer t(p, cvl::stage::object);
+                objects = detectInRegions(*models._objectDetector, frame, rois, cc);
+            }
+        }
+        if (cc->_stages & 4) {
+            drawMotion(frame, motion);
+        }
     }
 
     inline auto detectLength(cv::Mat& frame) {
-        auto cmpp =  cvl::Detector::detectArucoMarker(frame);
+        auto cmpp = _markerDetector->cmpp(frame);
         auto thresh = cvl::geometry::getBlurGreyThresholdFrame(frame);
         auto filtered_contours = filterRightAngleContours(thresh);
         for (const auto& contour : filtered_contours) {
@@ -84,12 +208,12 @@ struct pipeline {
         cv::drawContours(frame, filtered_contours, -1, cv::Scalar(0, 255, 0), 2);
     }
 
-    inline auto detectFaces(cv::Mat& frame, spcc cc) {
-        return _faceDetector->Detect(frame, cc);
+    inline auto detectFaces(cv::Mat& frame, spcc cc, model_set& models) {
+        return models._faceDetector->Detect(frame, cc);
     }
 
-    inline auto detectObjects(cv::Mat& frame, spcc cc) {
-        return _objectDetector->Detect(frame, cc);
+    inline auto detectObjects(cv::Mat& frame, spcc cc, model_set& models) {
+        return models._objectDetector->Detect(frame, cc);
     }
 
     inline auto faceRecognition(cv::Mat& frame, spcc cc) {
@@ -97,60 +221,87 @@ struct pipeline {
     }
 
     inline auto execute(cv::Mat& frame, spcc cc) {
+        execute(frame, cc, *_models);
+    }
+
+    inline void execute(cv::Mat& frame, spcc cc, model_set& models) {
 
         if (frame.empty()) return;
 
-        Detections detections;
+        auto p = _profile.get();
+        cvl::scoped_timer total(p, cvl::stage::execute);
+
+        // face boxes are kept apart so recognition only runs on those
+        Detections faces, detections;
         int stages = cc->_stages;
 
         if (cc->_flags & 2) {
+            cvl::scoped_timer t(p, cvl::stage::tracking);
             _tracker->updateTrackingContexts(frame, cc);
+            // between detector runs the trackers alone carry the boxes
+            if (!_tracker->detectionDue(cc)) {
+                stages &= 16;
+            }
         }
-        if (stages & 1) {
-            detections = detectFaces(frame, cc);
-        }
-        if (stages & 2) {
-            detections = detectObjects(frame, cc);
-        }
-        if (stages & 4) {
-            detections = detectMotion(frame, cc);
-        }
-        if (stages & 8) {
-
+        if ((cc->_flags & CASCADE_FLAG) && (stages & (1 | 2))) {
+            cvl::scoped_timer t(p, cvl::stage::cascade);
+            detectCascade(frame, cc, models, faces, detections);
+        } else {
+            if (stages & 1) {
+                cvl::scoped_timer t(p, cvl::stage::face);
+                faces = detectFaces(frame, cc, models);
+            }
+            if (stages & 2) {
+                cvl::scoped_timer t(p, cvl::stage::object);
+                faces.clear();
+                detections = detectObjects(frame, cc, models);
+            }
+            if (stages & 4) {
+                cvl::scoped_timer t(p, cvl::stage::motion);
+                faces.clear();
+                detections = detectMotion(frame, cc);
+            }
         }
         if (stages & 16) {
+            cvl::scoped_timer t(p, cvl::stage::length);
             detectLength(frame);
         }
 
+        cvl::Detector::FilterDetections(faces, frame);
         cvl::Detector::FilterDetections(detections, frame);
+        auto face_count = faces.size();
+        detections.insert(detections.begin(), faces.begin(), faces.end());
+
+        std::vector<bool> tracked;
+        if (cc->_flags & 2) {
+            cvl::scoped_timer t(p, cvl::stage::associate);
+            tracked = _tracker->associate(detections, frame);
+        }
 
-        _save_path = cc->_resultsFolder;
-        _save = (bool)cc->_resultsFolder.length();
+        bool save = (bool)cc->_resultsFolder.length();
 
-        for (auto i = 0; i < detections.size(); i++) {
+        for (size_t i = 0; i < detections.size(); i++) {
             std::string label;
             cvl::DetectionResult r;
             const auto& roi = detections[i];
-            r._mat = frame(roi).clone();
-            if (cc->_flags & 2) {
-                // match this detection with all tracking contexts
-                if (_tracker->matchDetectionWithTrackingContext(roi, frame)) {
-                    label += "T ";
-                } else {
-                    _tracker->addNewTrackingContext(roi, frame);
-                }
+            r._mat = frame(roi);
+            if (tracked.size() && tracked[i]) {
+                label += "T ";
             }
-            if ((stages & 8) && (stages & 1)) {
+            if ((stages & 8) && i < face_count) {
+                cvl::scoped_timer t(p, cvl::stage::facerec);
                 const auto& [id, confidence] = faceRecognition(r._mat, cc);
                 if (id > 0 && confidence > 0) {
                     label += _faceRecognizer->getTagFromId(id) + ": " + geometry::toStringWithPrecision<2>(confidence);
                 }
             }
-            if (_save) {
+            if (save) {
+                cvl::scoped_timer t(p, cvl::stage::snapshot);
                 r._stages = stages;
                 r._ts = duration_cast<std::chrono::microseconds>(
                     std::chrono::system_clock::now().time_since_epoch()).count();
-                _detectionsQueue.enqueue(r);
+                // the frame buffer is reused, only saved crops are copied
+                _encoder->submit(r._mat.clone(), cc->_resultsFolder + "/" + std::to_string(r._ts));
             }
             cv::rectangle(frame, roi, cv::Scalar(0, 255, 0), cc->_bbThickness);
             cv::putText(frame, label, cv::Point((int)roi.x, (int)(roi.y - 5)), cv::FONT_HERSHEY_SIMPLEX,
@@ -160,36 +311,17 @@ struct pipeline {
 
     protected:
 
-    bool _stop = false;
-    bool _save = false;
-    std::thread _thread;
-    std::string _save_path;
     std::unique_ptr<cvl::Tracker> _tracker = nullptr;
-    cvl::queue<cvl::DetectionResult> _detectionsQueue;
-    std::unique_ptr<cvl::FaceRecognizer> _faceRecognizer;
-    std::unique_ptr<cvl::FaceDetector> _faceDetector = nullptr;
-    std::unique_ptr<cvl::ObjectDetector> _objectDetector = nullptr;
+    std::shared_ptr<cvl::encoder_pool> _encoder = nullptr;
+    std::shared_ptr<cvl::profile> _profile = nullptr;
+    std::unique_ptr<cvl::MarkerDetector> _markerDetector = nullptr;
+    std::shared_ptr<model_set> _models = nullptr;
+    std::shared_ptr<cvl::FaceRecognizer> _faceRecognizer = nullptr;
     std::unique_ptr<cvl::BackgroundSubtractor> _backgroundSubtractor = nullptr;
 
     auto compute_ema(double current, double previous, double alpha) {
         return alpha * current + (1.0 - alpha) * previous;
     }
-
-    void detectionSaveThread() {
-        while (!_stop) {
-            if (!_save || _save_path.length() == 0) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(350));
-                continue;
-            }
-            auto d = _detectionsQueue.dequeue();
-            if (d.empty()) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(50));
-                continue;
-            }
-            cvl::geometry::saveMatAsImage(d._mat, _save_path + "/" +
-                    std::to_string(d._ts), ".jpg");
-        }
-    }
 };
 
 }
@@ -0,0 +1,452 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <bit>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include <condition_variable>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#include <osl/log>
+
+namespace cvl {
+
+// where the time of a frame goes. camera stages run on the capture thread,
+// pipeline stages on whichever thread executes it, encode and notify on the
+// process wide encoder pool and notifier
+enum class stage : uint8_t {
+    capture,
+    square,
+    execute,
+    tracking,
+    motion,
+    cascade,
+    face,
+    object,
+    length,
+    associate,
+    facerec,
+    snapshot,
+    encode,
+    notify,
+    count
+};
+
+inline constexpr const char *stage_names[] = {
+    "capture", "square", "execute", "tracking", "motion", "cascade", "face",
+    "object", "length", "associate", "facerec", "snapshot", "encode", "notify"
+};
+
+// last reported values, set by their owners as they change
+enum class gauge : uint8_t {
+    captured,
+    processed,
+    queue_in,
+    queue_out,
+    dropped_in,
+    dropped_out,
+    snapshots_dropped,
+    notifications_dropped,
+    count
+};
+
+inline constexpr const char *gauge_names[] = {
+    "captured_frames", "processed_frames", "queue_in_depth", "queue_out_depth",
+    "dropped_in_frames", "dropped_out_frames", "dropped_snapshots", "dropped_notifications"
+};
+
+// bucket i counts the samples under 2^i microseconds, the last one the
+// rest (about 8s and up)
+constexpr size_t LATENCY_BUCKETS = 24;
+
+struct stage_stats {
+    uint64_t count = 0;
+    double sum_ms = 0;
+    std::array<uint64_t, LATENCY_BUCKETS + 1> buckets = {};
+
+    double mean_ms(void) const {
+        return count ? sum_ms / count : 0;
+    }
+
+    // upper bound of the bucket the quantile falls in
+    double quantile_ms(double q) const {
+        uint64_t seen = 0, target = (uint64_t)(q * count);
+        for (size_t i = 0; i < buckets.size(); i++) {
+            seen += buckets[i];
+            if (seen > target) {
+                return (double)(1ull << std::min(i, LATENCY_BUCKETS - 1)) / 1000;
+            }
+        }
+        return 0;
+    }
+};
+
+struct profile_snapshot {
+    std::string name;
+    std::array<stage_stats, (size_t)stage::count> stages;
+    std::array<int64_t, (size_t)gauge::count> gauges = {};
+    std::array<bool, (size_t)gauge::count> reported = {};
+};
+
+// per camera histograms and gauges. recording is a few relaxed atomic adds
+// so it costs about as much as the two clock reads around it
+struct profile {
+
+    explicit profile(std::string name) : _name(std::move(name)) {}
+
+    const std::string& name(void) const {
+        return _name;
+    }
+
+    void record(stage s, std::chrono::nanoseconds d) {
+        auto& h = _stages[(size_t)s];
+        auto us = (uint64_t)std::max<int64_t>(d.count(), 0) / 1000;
+        auto bucket = std::min<size_t>(std::bit_width(us), LATENCY_BUCKETS);
+        h._buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        h._count.fetch_add(1, std::memory_order_relaxed);
+        h._sum_ns.fetch_add((uint64_t)d.count(), std::memory_order_relaxed);
+    }
+
+    void set(gauge g, int64_t value) {
+        _gauges[(size_t)g].store(value, std::memory_order_relaxed);
+        _reported[(size_t)g].store(true, std::memory_order_relaxed);
+    }
+
+    profile_snapshot snapshot(void) const {
+        profile_snapshot s;
+        s.name = _name;
+        for (size_t i = 0; i < s.stages.size(); i++) {
+            const auto& h = _stages[i];
+            s.stages[i].count = h._count.load(std::memory_order_relaxed);
+            s.stages[i].sum_ms = h._sum_ns.load(std::memory_order_relaxed) / 1e6;
+            for (size_t b = 0; b <= LATENCY_BUCKETS; b++) {
+                s.stages[i].buckets[b] = h._buckets[b].load(std::memory_order_relaxed);
+            }
+        }
+        for (size_t i = 0; i < s.gauges.size(); i++) {
+            s.gauges[i] = _gauges[i].load(std::memory_order_relaxed);
+            s.reported[i] = _reported[i].load(std::memory_order_relaxed);
+        }
+        return s;
+    }
+
+    private:
+
+    struct histogram {
+        std::atomic<uint64_t> _count{0};
+        std::atomic<uint64_t> _sum_ns{0};
+        std::array<std::atomic<uint64_t>, LATENCY_BUCKETS + 1> _buckets = {};
+    };
+
+    std::string _name;
+    std::array<histogram, (size_t)stage::count> _stages;
+    std::array<std::atomic<int64_t>, (size_t)gauge::count> _gauges = {};
+    std::array<std::atomic<bool>, (size_t)gauge::count> _reported = {};
+};
+
+// times its scope into a stage. a null profile reads no clock at all, so
+// unprofiled pipelines pay one branch per stage
+struct scoped_timer {
+
+    scoped_timer(profile *p, stage s) : _profile(p), _stage(s) {
+        if (_profile) {
+            _start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~scoped_timer() {
+        if (_profile) {
+            _profile->record(_stage, std::chrono::steady_clock::now() - _start);
+        }
+    }
+
+    scoped_timer(const scoped_timer&) = delete;
+    scoped_timer& operator=(const scoped_timer&) = delete;
+
+    private:
+
+    profile *_profile;
+    stage _stage;
+    std::chrono::steady_clock::time_point _start;
+};
+
+// the profiles of the process. snapshot() is the pull api; prometheus()
+// renders the same in the text exposition format, which dump() writes to a
+// file (for a node exporter textfile collector) and serve() answers on a
+// loopback port
+struct profiler {
+
+    profiler() {
+        _process = std::make_shared<profile>("process");
+    }
+
+    ~profiler() {
+        {
+            std::lock_guard<std::mutex> lg(_mux);
+            _stop = true;
+        }
+        _cv.notify_all();
+        for (auto& t : _threads) {
+            t.join();
+        }
+    }
+
+    // exports are opt in from the environment: CVL_METRICS_FILE is
+    // rewritten every 10s, CVL_METRICS_PORT is served on loopback
+    static profiler& shared() {
+        static profiler p;
+        static bool exported = [](){
+            if (auto path = std::getenv("CVL_METRICS_FILE")) {
+                p.dump_every(path, std::chrono::seconds(10));
+            }
+            if (auto port = std::getenv("CVL_METRICS_PORT")) {
+                p.serve((uint16_t)std::atoi(port));
+            }
+            return true;
+        }();
+        (void)exported;
+        return p;
+    }
+
+    // the encoder pool and notifier are shared by all cameras. held by
+    // them, so it outlives a profiler destroyed before them at exit
+    std::shared_ptr<profile> process(void) {
+        return _process;
+    }
+
+    // kept as long as the caller holds it
+    std::shared_ptr<profile> add(const std::string& name) {
+        auto p = std::make_shared<profile>(name);
+        std::lock_guard<std::mutex> lg(_mux);
+        _profiles.erase(std::remove_if(_profiles.begin(), _profiles.end(),
+            [](const auto& w){ return w.expired(); }), _profiles.end());
+        _profiles.push_back(p);
+        return p;
+    }
+
+    std::vector<profile_snapshot> snapshot(void) {
+        std::vector<std::shared_ptr<profile>> live = {_process};
+        {
+            std::lock_guard<std::mutex> lg(_mux);
+            for (const auto& w : _profiles) {
+                if (auto p = w.lock()) {
+                    live.push_back(p);
+                }
+            }
+        }
+        std::vector<profile_snapshot> out;
+        for (const auto& p : live) {
+            out.push_back(p->snapshot());
+        }
+        return out;
+    }
+
+    std::string prometheus(void) {
+        auto snapshots = snapshot();
+        std::ostringstream os;
+        os << "# HELP cvl_stage_seconds time spent per frame in a stage\n";
+        os << "# TYPE cvl_stage_seconds histogram\n";
+        for (const auto& s : snapshots) {
+            auto camera = escape(s.name);
+            for (size_t i = 0; i < s.stages.size(); i++) {
+                const auto& st = s.stages[i];
+                if (!st.count) {
+                    continue;
+                }
+                auto labels = "camera=\"" + camera + "\",stage=\"" + stage_names[i] + "\"";
+                uint64_t cumulative = 0;
+                for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+                    cumulative += st.buckets[b];
+                    os << "cvl_stage_seconds_bucket{" << labels << ",le=\""
+                       << (double)(1ull << b) / 1e6 << "\"} " << cumulative << "\n";
+                }
+                os << "cvl_stage_seconds_bucket{" << labels << ",le=\"+Inf\"} " << st.count << "\n";
+                os << "cvl_stage_seconds_sum{" << labels << "} " << st.sum_ms / 1000 << "\n";
+                os << "cvl_stage_seconds_count{" << labels << "} " << st.count << "\n";
+            }
+        }
+        for (size_t g = 0; g < (size_t)gauge::count; g++) {
+            bool header = false;
+            for (const auto& s : snapshots) {
+                if (!s.reported[g]) {
+                    continue;
+                }
+                if (!header) {
+                    os << "# TYPE cvl_" << gauge_names[g] << " gauge\n";
+                    header = true;
+                }
+                os << "cvl_" << gauge_names[g] << "{camera=\"" << escape(s.name) << "\"} " << s.gauges[g] << "\n";
+            }
+        }
+        return os.str();
+    }
+
+    // written to a temporary and renamed so a scraper never reads half
+    bool dump(const std::string& path) {
+        auto tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::out | std::ios::trunc);
+            out << prometheus();
+            if (!out) {
+                ERR << "profiler could not write " << tmp;
+                return false;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, path, ec);
+        return !ec;
+    }
+
+    void dump_every(const std::string& path, std::chrono::milliseconds interval) {
+        std::lock_guard<std::mutex> lg(_mux);
+        _threads.emplace_back([this, path, interval]() {
+            std::unique_lock<std::mutex> ul(_mux);
+            while (!_cv.wait_for(ul, interval, [&](){ return _stop; })) {
+                ul.unlock();
+                dump(path);
+                ul.lock();
+            }
+        });
+    }
+
+    // answers any request on 127.0.0.1:port with the metrics. port 0 picks
+    // a free one; returns the port, 0 on failure
+    uint16_t serve(uint16_t port) {
+        #ifdef _WIN32
+        WSADATA wsa;
+        WSAStartup(MAKEWORD(2, 2), &wsa);
+        #endif
+        auto s = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (!valid(s)) {
+            ERR << "profiler socket failed";
+            return 0;
+        }
+        int one = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (::bind(s, (sockaddr *)&addr, sizeof(addr)) || ::listen(s, 4) ||
+                getsockname(s, (sockaddr *)&addr, &len)) {
+            ERR << "profiler could not listen on port " << port;
+            close(s);
+            return 0;
+        }
+        std::lock_guard<std::mutex> lg(_mux);
+        _threads.emplace_back(&profiler::accept_loop, this, s);
+        return ntohs(addr.sin_port);
+    }
+
+    private:
+
+    #ifdef _WIN32
+    using socket_t = SOCKET;
+    static bool valid(socket_t s) { return s != INVALID_SOCKET; }
+    static void close(socket_t s) { closesocket(s); }
+    static int wait_readable(socket_t s, int ms) {
+        WSAPOLLFD p = {s, POLLRDNORM, 0};
+        return WSAPoll(&p, 1, ms);
+    }
+    static constexpr int SEND_FLAGS = 0;
+    #else
+    using socket_t = int;
+    static bool valid(socket_t s) { return s >= 0; }
+    static void close(socket_t s) { ::close(s); }
+    static int wait_readable(socket_t s, int ms) {
+        pollfd p = {s, POLLIN, 0};
+        return ::poll(&p, 1, ms);
+    }
+    // a scraper hanging up mid response must not raise sigpipe in the host,
+    // macos has no MSG_NOSIGNAL and sets SO_NOSIGPIPE on the socket instead
+    #ifdef MSG_NOSIGNAL
+    static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+    #else
+    static constexpr int SEND_FLAGS = 0;
+    #endif
+    #endif
+
+    bool _stop = false;
+    std::mutex _mux;
+    std::condition_variable _cv;
+    std::shared_ptr<profile> _process;
+    std::vector<std::thread> _threads;
+    std::vector<std::weak_ptr<profile>> _profiles;
+
+    static std::string escape(const std::string& v) {
+        std::string out;
+        for (auto c : v) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+            }
+            out += (c == '\n') ? ' ' : c;
+        }
+        return out;
+    }
+
+    bool stopping(void) {
+        std::lock_guard<std::mutex> lg(_mux);
+        return _stop;
+    }
+
+    // one request at a time, scrapes are rare. polls so the destructor is
+    // never stuck behind accept
+    void accept_loop(socket_t s) {
+        char request[1024];
+        while (!stopping()) {
+            if (wait_readable(s, 200) <= 0) {
+                continue;
+            }
+            auto c = ::accept(s, nullptr, nullptr);
+            if (!valid(c)) {
+                continue;
+            }
+            #ifdef SO_NOSIGPIPE
+            int one = 1;
+            setsockopt(c, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+            #endif
+            if (wait_readable(c, 1000) > 0) {
+                ::recv(c, request, sizeof(request), 0);
+                auto body = prometheus();
+                auto response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                    std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+                for (size_t sent = 0; sent < response.size(); ) {
+                    auto n = ::send(c, response.data() + sent, (int)(response.size() - sent), SEND_FLAGS);
+                    if (n <= 0) {
+                        break;
+                    }
+                    sent += n;
+                }
+            }
+            close(c);
+        }
+        close(s);
+    }
+};
+
+}
+
+#endif
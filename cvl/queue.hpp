@@ -3,64 +3,197 @@
 
 #include <mutex>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
 
 #include <opencv2/core.hpp>
 
 namespace cvl {
 
+// bounded single producer / single consumer ring. elements are moved in
+// and out (a cv::Mat only moves its header), a full ring drops its oldest
+// element. slots carry sequence numbers (vyukov) so the producer can
+// claim the oldest element with the same CAS on the read index the
+// consumer uses, one CAS drops exactly one element.
 template <typename T, int N = 50>
 struct queue {
 
-    queue() = default;
+    queue() {
+        for (size_t i = 0; i < N; i++) {
+            _slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
     ~queue(){}
 
-    auto enqueue(const T& frame) {
-        std::lock_guard<std::mutex> lg(_mux);
-        _queue[_write_index % N] = frame;
-        _write_index = (_write_index + 1) % N;
+    // returns false if an older element had to be dropped to make room
+    bool enqueue(T&& e) {
+        bool dropped = false;
+        auto pos = _write_index.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& s = _slots[pos % N];
+            if (s.seq.load(std::memory_order_acquire) == pos) {
+                s.value = std::move(e);
+                s.seq.store(pos + 1, std::memory_order_release);
+                _write_index.store(pos + 1, std::memory_order_release);
+                break;
+            }
+            // the element this slot last held. if the consumer already
+            // claimed it, it is still moving it out and nothing is dropped
+            auto oldest = pos - N;
+            if (_read_index.compare_exchange_strong(oldest, oldest + 1,
+                    std::memory_order_relaxed)) {
+                T old{std::move(s.value)};
+                s.seq.store(pos, std::memory_order_release);
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                dropped = true;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        _enqueued.fetch_add(1, std::memory_order_relaxed);
+        // pairs with the fence in wait_dequeue so a consumer going to sleep
+        // either sees this element or is seen as a waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_waiters.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lg(_mux);
+            _cv.notify_one();
+        }
+        return !dropped;
+    }
+
+    bool enqueue(const T& e) {
+        T copy = e;
+        return enqueue(std::move(copy));
     }
 
-    auto dequeue() {
-        std::lock_guard<std::mutex> lg(_mux);
-        auto& e = _queue[_read_index % N];
-        if (!e.empty()) {
-            _read_index = (_read_index + 1) % N;
+    // non blocking, returns an empty T if there is nothing queued
+    T dequeue() {
+        T e{};
+        pop(e);
+        return e;
+    }
+
+    // blocks until an element arrives or the timeout expires
+    template <typename R, typename P>
+    bool wait_dequeue(T& e, std::chrono::duration<R, P> timeout) {
+        if (pop(e)) {
+            return true;
         }
-        auto clone = e.clone();
-        e = T();
-        return clone;
+        std::unique_lock<std::mutex> ul(_mux);
+        _waiters++;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto found = _cv.wait_for(ul, timeout, [&](){ return pop(e); });
+        _waiters--;
+        return found;
     }
 
+    // only while neither side is running
     auto clear() {
-        _read_index = 0;
-        _write_index = 0;
-        std::ranges::fill(_queue, T());
+        T e{};
+        while (pop(e)) {}
     }
 
     auto size() const {
-        return N;
+        auto w = _write_index.load(std::memory_order_acquire);
+        auto r = _read_index.load(std::memory_order_acquire);
+        return (w > r) ? static_cast<size_t>(w - r) : 0;
     }
 
-    const T& latest() const {
-        return _queue[_write_index];
+    auto capacity() const {
+        return N;
     }
 
-    const T& oldest() const {
-        return _queue[_read_index];
+    uint64_t enqueued() const {
+        return _enqueued.load(std::memory_order_relaxed);
     }
 
-    const T& operator [](int i) const {
-        return _queue[i];
+    uint64_t dropped() const {
+        return _dropped.load(std::memory_order_relaxed);
     }
 
     private:
 
+    struct slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
     std::mutex _mux;
-    int _read_index = 0;
-    int _write_index = 0;
-    std::array<T, N> _queue;
+    std::condition_variable _cv;
+    std::atomic<int> _waiters{0};
+    std::atomic<size_t> _read_index{0};
+    std::atomic<size_t> _write_index{0};
+    std::atomic<uint64_t> _enqueued{0};
+    std::atomic<uint64_t> _dropped{0};
+    std::array<slot, N> _slots;
+
+    bool pop(T& e) {
+        auto pos = _read_index.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& s = _slots[pos % N];
+            auto seq = s.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (_read_index.compare_exchange_weak(pos, pos + 1,
+                        std::memory_order_relaxed)) {
+                    e = std::move(s.value);
+                    s.seq.store(pos + N, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _read_index.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// fixed set of frame buffers handed out as cv::Mat headers. a buffer is
+// free again once every header that references it has been released, so
+// frames can travel through the queues without being copied or freed.
+struct mat_pool {
+
+    mat_pool(int count = 8) : _buffers(count) {}
+
+    cv::Mat acquire(cv::Size size, int type) {
+        for (auto& b : _buffers) {
+            if (b.u && CV_XADD(&b.u->refcount, 0) != 1) {
+                continue;
+            }
+            auto data = b.data;
+            b.create(size, type);
+            if (b.data != data) {
+                _allocations++;
+            }
+            return b;
+        }
+        // every buffer is still referenced downstream
+        _exhausted++;
+        _allocations++;
+        return cv::Mat(size, type);
+    }
+
+    uint64_t allocations() const {
+        return _allocations;
+    }
+
+    uint64_t exhausted() const {
+        return _exhausted;
+    }
+
+    private:
+
+    uint64_t _allocations = 0;
+    uint64_t _exhausted = 0;
+    std::vector<cv::Mat> _buffers;
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
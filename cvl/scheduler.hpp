@@ -0,0 +1,249 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+#include <pipeline.hpp>
+
+#include <opencv2/core.hpp>
+
+namespace cvl {
+
+using TProcessedCallback = std::function<void (cv::Mat&&)>;
+
+enum class schedule : uint8_t {
+    round_robin,
+    priority
+};
+
+struct stream_stats {
+    uint64_t submitted = 0;
+    uint64_t processed = 0;
+    // arrived sooner than the stream's fps target allows
+    uint64_t skipped = 0;
+    // replaced by a newer frame before a worker picked it up
+    uint64_t dropped = 0;
+};
+
+// runs the pipelines of many cameras on one sized worker pool. each worker
+// owns a model_set and all streams share one face recognizer, so the model
+// count follows the worker count rather than the camera count. tracker and
+// background model stay per stream; a stream is only ever run by one worker
+// at a time so its frames are processed in order.
+//
+// with a batch size above one the workers share a single BatchedDetector
+// per network instead, which runs the frames of up to batch workers in one
+// forward. a batch can't be larger than the worker count.
+struct scheduler {
+
+    scheduler(size_t workers = 0, schedule policy = schedule::round_robin,
+            size_t batch = 0, std::chrono::microseconds deadline = std::chrono::milliseconds(5))
+            : _policy(policy) {
+        if (!workers) {
+            workers = std::max(1u, std::thread::hardware_concurrency() / 2);
+        }
+        _recognizer = make_face_recognizer();
+        std::shared_ptr<model_set> batched;
+        if (batch > 1) {
+            batch = std::min(batch, workers);
+            _faceBatcher = std::make_shared<cvl::BatchedDetector>(
+                std::make_unique<cvl::FaceDetector>(), batch, deadline);
+            _objectBatcher = std::make_shared<cvl::BatchedDetector>(
+                std::make_unique<cvl::ObjectDetector>("person"), batch, deadline);
+            batched = std::make_shared<model_set>(_faceBatcher, _objectBatcher);
+        }
+        for (size_t i = 0; i < workers; i++) {
+            _workers.emplace_back(&scheduler::worker, this,
+                batched ? batched : std::make_shared<model_set>());
+        }
+    }
+
+    ~scheduler() {
+        {
+            std::lock_guard<std::mutex> lg(_mux);
+            _stop = true;
+        }
+        _cv.notify_all();
+        for (auto& w : _workers) {
+            w.join();
+        }
+    }
+
+    // a target_fps of 0 accepts every frame the worker pool can keep up with
+    int add_stream(spcc cc, TProcessedCallback cbk, int priority = 0, double target_fps = 0,
+            std::shared_ptr<cvl::profile> profile = nullptr) {
+        auto s = std::make_shared<stream>();
+        s->_cc = cc;
+        s->_cbk = cbk;
+        s->_priority = priority;
+        if (target_fps > 0) {
+            s->_interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(1.0 / target_fps));
+        }
+        s->_pipeline = std::make_unique<cvl::pipeline>(nullptr, _recognizer);
+        s->_pipeline->set_profile(profile);
+        std::lock_guard<std::mutex> lg(_mux);
+        _streams.push_back(s);
+        return (int)_streams.size() - 1;
+    }
+
+    // waits for a frame of this stream that is still being processed
+    void remove_stream(int id) {
+        std::shared_ptr<stream> s;
+        {
+            std::unique_lock<std::mutex> ul(_mux);
+            if (id < 0 || id >= (int)_streams.size() || !_streams[id]) {
+                return;
+            }
+            s = _streams[id];
+            _done.wait(ul, [&](){ return !s->_busy; });
+            _streams[id].reset();
+        }
+        // the pipeline is released outside the lock
+    }
+
+    // called from capture threads, never waits for inference. only the
+    // latest frame of a stream is kept, so an overloaded pool drops frames
+    // instead of adding latency
+    bool submit(int id, cv::Mat&& frame) {
+        std::lock_guard<std::mutex> lg(_mux);
+        if (id < 0 || id >= (int)_streams.size() || !_streams[id]) {
+            return false;
+        }
+        auto& s = _streams[id];
+        s->_stats.submitted++;
+        auto now = std::chrono::steady_clock::now();
+        if (s->_interval.count() && now - s->_last < s->_interval) {
+            s->_stats.skipped++;
+            return false;
+        }
+        s->_last = now;
+        if (!s->_pending.empty()) {
+            s->_stats.dropped++;
+        }
+        s->_pending = std::move(frame);
+        _cv.notify_one();
+        return true;
+    }
+
+    // nothing queued or in flight for this stream
+    bool idle(int id) {
+        std::lock_guard<std::mutex> lg(_mux);
+        if (id < 0 || id >= (int)_streams.size() || !_streams[id]) {
+            return true;
+        }
+        return _streams[id]->_pending.empty() && !_streams[id]->_busy;
+    }
+
+    stream_stats stats(int id) {
+        std::lock_guard<std::mutex> lg(_mux);
+        if (id < 0 || id >= (int)_streams.size() || !_streams[id]) {
+            return {};
+        }
+        return _streams[id]->_stats;
+    }
+
+    size_t workers() const {
+        return _workers.size();
+    }
+
+    // mean frames per forward of the batched detectors, 0 when not batching
+    double mean_batch() const {
+        uint64_t batches = 0, frames = 0;
+        for (const auto& b : {_faceBatcher, _objectBatcher}) {
+            if (b) {
+                batches += b->batches();
+                frames += b->frames();
+            }
+        }
+        return batches ? (double)frames / batches : 0;
+    }
+
+    private:
+
+    struct stream {
+        spcc _cc;
+        int _priority = 0;
+        bool _busy = false;
+        cv::Mat _pending;
+        stream_stats _stats;
+        TProcessedCallback _cbk;
+        std::chrono::steady_clock::duration _interval{0};
+        std::chrono::steady_clock::time_point _last;
+        std::unique_ptr<cvl::pipeline> _pipeline;
+    };
+
+    bool _stop = false;
+    size_t _cursor = 0;
+    schedule _policy;
+    std::mutex _mux;
+    std::condition_variable _cv;
+    std::condition_variable _done;
+    std::vector<std::thread> _workers;
+    std::shared_ptr<cvl::FaceRecognizer> _recognizer;
+    std::shared_ptr<cvl::BatchedDetector> _faceBatcher;
+    std::shared_ptr<cvl::BatchedDetector> _objectBatcher;
+    std::vector<std::shared_ptr<stream>> _streams;
+
+    // with _mux held. scans from the stream after the last one served so
+    // every stream gets a turn; under priority the highest ready priority
+    // wins and equal priorities still rotate
+    std::shared_ptr<stream> next(void) {
+        std::shared_ptr<stream> best;
+        size_t best_index = 0, n = _streams.size();
+        for (size_t i = 0; i < n; i++) {
+            auto index = (_cursor + i) % n;
+            const auto& s = _streams[index];
+            if (!s || s->_busy || s->_pending.empty()) {
+                continue;
+            }
+            if (!best || s->_priority > best->_priority) {
+                best = s;
+                best_index = index;
+            }
+            if (_policy == schedule::round_robin) {
+                break;
+            }
+        }
+        if (best) {
+            _cursor = (best_index + 1) % n;
+        }
+        return best;
+    }
+
+    void worker(std::shared_ptr<model_set> models) {
+        std::unique_lock<std::mutex> ul(_mux);
+        while (!_stop) {
+            auto s = next();
+            if (!s) {
+                _cv.wait(ul);
+                continue;
+            }
+            auto frame = std::move(s->_pending);
+            s->_busy = true;
+            ul.unlock();
+            if (s->_cc->_stages) {
+                s->_pipeline->execute(frame, s->_cc, *models);
+            }
+            if (s->_cbk) {
+                s->_cbk(std::move(frame));
+            }
+            ul.lock();
+            s->_busy = false;
+            s->_stats.processed++;
+            _done.notify_all();
+        }
+        DBG << "scheduler worker returning";
+    }
+};
+
+}
+
+#endif
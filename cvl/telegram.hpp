@@ -1,13 +1,26 @@
 #ifndef TELEGRAM_HPP
 #define TELEGRAM_HPP
 
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <thread>
 #include <string>
 #include <vector>
+#include <sstream>
 #include <iostream>
+#include <condition_variable>
+
+#include <profiler.hpp>
 
 #include <curl/curl.h>
 
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
 namespace cvl {
 
 inline void send_telegram_message(const std::string& bot_token, const std::string& chat_id, const std::string& message) {
@@ -25,72 +38,353 @@ inline void send_telegram_message(const std::string& bot_token, const std::strin
     }
 }
 
-inline void send_telegram_photos(const std::string& bot_token, const std::string& chat_id, const std::vector<std::string>& image_paths) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return;
-    std::string url = "https://api.telegram.org/bot" + bot_token + "/sendMediaGroup";
-    // Build JSON media array
-    std::string media = "[";
-    for (size_t i = 0; i < image_paths.size(); ++i) {
-        if (i > 0) media += ",";
-        std::string filename = "photo" + std::to_string(i) + ".jpg";
-        media += "{\"type\":\"photo\",\"media\":\"attach://" + filename + "\",\"caption\":\"Image " + std::to_string(i+1) + "\"}";
-    }
-    media += "]";
-    curl_mime* mime = curl_mime_init(curl);
-    // Add chat_id
-    curl_mimepart* part = curl_mime_addpart(mime);
-    curl_mime_name(part, "chat_id");
-    curl_mime_data(part, chat_id.c_str(), CURL_ZERO_TERMINATED);
-    // Add media JSON
-    part = curl_mime_addpart(mime);
-    curl_mime_name(part, "media");
-    curl_mime_data(part, media.c_str(), CURL_ZERO_TERMINATED);
-    // Add each image
-    for (size_t i = 0; i < image_paths.size(); ++i) {
-        part = curl_mime_addpart(mime);
-        curl_mime_name(part, ("photo" + std::to_string(i) + ".jpg").c_str());
-        curl_mime_filedata(part, image_paths[i].c_str());
-    }
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        std::cout << "curl error: " << curl_easy_strerror(res) << std::endl;
-    }
-    curl_mime_free(mime);
-    curl_easy_cleanup(curl);
-}
+struct notifier_stats {
+    uint64_t queued = 0;
+    uint64_t dropped = 0;
+    uint64_t requests = 0;
+    uint64_t photos = 0;
+    uint64_t failed = 0;
+    uint64_t throttled = 0;
+};
 
-inline void telegram_notify(const std::vector<cv::Mat>& thumbnails, spcc cc) {
-    std::vector<std::pair<int, double>> lv_scores;
-    for (int i = 0; i < thumbnails.size(); i++) {
-        lv_scores.push_back({i, cvl::geometry::computeLaplacianVariance(thumbnails[i])});
-    }
-    std::ranges::sort(lv_scores, [](auto& e1, auto& e2){ return e1.second < e2.second; });
-    // for (const auto& e : lv_scores) {
-    //     std::cout << e.first << ": " << e.second << std::endl;
-    // }
-    std::vector<std::string> paths;
-    int idx = lv_scores[lv_scores.size() - 1].first;
-    std::string path = "./thumb_" + std::to_string(idx) + ".jpg";
-    cv::imwrite(path, thumbnails[idx]);
-    paths.push_back(path);
-    std::string chatids = cc->_chatids;
-    std::string bot_token = cc->_botToken;
-    std::thread([=]() {
-        std::string word;
-        std::istringstream iss(chatids);
-        std::vector<std::string> chat_ids;
-        while (iss >> word) chat_ids.push_back(word);
-        std::string message  = "Face Detection Alert";
-        if (bot_token.size() && chat_ids.size()) {
-            for (const auto& chat_id : chat_ids) {
-                //send_telegram_message(bot_token, chat_id, message);
-                send_telegram_photos(bot_token, chat_id, paths);
+// bot api limit for sendMediaGroup
+constexpr size_t MEDIA_GROUP_MAX = 10;
+
+// sends the alerts of every camera from one thread through one curl multi
+// handle, so connections are kept alive and reused. photos are jpeg encoded
+// in memory. a chat gets at most one request per interval, photos arriving
+// in between (or within coalesce of the first) go out as one media group
+struct notifier {
+
+    notifier(const std::string& api = "https://api.telegram.org", size_t capacity = 32,
+            std::chrono::milliseconds interval = std::chrono::seconds(3),
+            std::chrono::milliseconds coalesce = std::chrono::seconds(1), int quality = 85)
+            : _api(api), _capacity(capacity), _interval(interval), _coalesce(coalesce), _quality(quality),
+              _profile(profiler::shared().process()) {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        _multi = curl_multi_init();
+        _thread = std::thread(&notifier::run, this);
+    }
+
+    ~notifier() {
+        _stop = true;
+        curl_multi_wakeup(_multi);
+        _thread.join();
+        for (auto& r : _requests) {
+            if (r->_active) {
+                curl_multi_remove_handle(_multi, r->_easy);
             }
+            curl_mime_free(r->_mime);
+            curl_easy_cleanup(r->_easy);
         }
-    }).detach();
+        curl_multi_cleanup(_multi);
+    }
+
+    static std::shared_ptr<notifier> shared() {
+        static auto n = std::make_shared<notifier>();
+        return n;
+    }
+
+    // chat_ids is whitespace separated. false if the queue had no room for
+    // some chat
+    bool notify(const std::string& bot_token, const std::string& chat_ids, const cv::Mat& photo, const std::string& caption) {
+        bool queued = true;
+        auto copy = photo.clone();
+        std::string chat_id;
+        std::istringstream iss(chat_ids);
+        {
+            std::lock_guard<std::mutex> lg(_mux);
+            while (iss >> chat_id) {
+                if (_pending >= _capacity) {
+                    _stats.dropped++;
+                    _profile->set(gauge::notifications_dropped, (int64_t)_stats.dropped);
+                    queued = false;
+                    continue;
+                }
+                auto& c = _chats[bot_token + "/" + chat_id];
+                if (c._photos.empty()) {
+                    c._first = std::chrono::steady_clock::now();
+                }
+                c._token = bot_token;
+                c._chat_id = chat_id;
+                c._photos.push_back({copy, caption, std::chrono::steady_clock::now()});
+                _pending++;
+                _stats.queued++;
+            }
+        }
+        curl_multi_wakeup(_multi);
+        return queued;
+    }
+
+    // waits until nothing is queued or in flight
+    template <typename R, typename P>
+    bool flush(std::chrono::duration<R, P> timeout) {
+        std::unique_lock<std::mutex> ul(_mux);
+        return _idle.wait_for(ul, timeout, [&](){ return _pending == 0; });
+    }
+
+    notifier_stats stats(void) {
+        std::lock_guard<std::mutex> lg(_mux);
+        return _stats;
+    }
+
+    private:
+
+    struct photo {
+        cv::Mat _mat;
+        std::string _caption;
+        std::chrono::steady_clock::time_point _queued;
+    };
+
+    struct chat {
+        std::string _token;
+        std::string _chat_id;
+        bool _in_flight = false;
+        std::deque<photo> _photos;
+        std::chrono::steady_clock::time_point _first;
+        std::chrono::steady_clock::time_point _next;
+    };
+
+    struct request {
+        bool _active = false;
+        CURL *_easy = nullptr;
+        curl_mime *_mime = nullptr;
+        std::string _key;
+        std::string _token;
+        std::string _chat_id;
+        std::string _url;
+        std::string _media;
+        std::string _response;
+        std::vector<photo> _photos;
+        std::vector<uchar> _jpeg;
+    };
+
+    std::string _api;
+    size_t _capacity;
+    std::chrono::milliseconds _interval;
+    std::chrono::milliseconds _coalesce;
+    int _quality;
+    std::shared_ptr<profile> _profile;
+    std::mutex _mux;
+    std::condition_variable _idle;
+    size_t _pending = 0;
+    notifier_stats _stats;
+    std::map<std::string, chat> _chats;
+    std::atomic<bool> _stop{false};
+    CURLM *_multi = nullptr;
+    std::thread _thread;
+    std::vector<std::unique_ptr<request>> _requests;
+
+    static size_t write_cbk(char *b, size_t size, size_t n, void *user) {
+        static_cast<std::string *>(user)->append(b, size * n);
+        return size * n;
+    }
+
+    static std::string escape(const std::string& text) {
+        std::string out;
+        for (auto c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out;
+    }
+
+    void run() {
+        while (!_stop) {
+            auto wait = dispatch();
+            int running = 0;
+            curl_multi_perform(_multi, &running);
+            // a finished request may have left its chat due right away
+            if (!collect()) {
+                curl_multi_poll(_multi, nullptr, 0, wait, nullptr);
+            }
+        }
+    }
+
+    // starts a request for every chat that is due, returns the ms until
+    // the next one will be
+    int dispatch(void) {
+        auto now = std::chrono::steady_clock::now();
+        auto next = now + std::chrono::seconds(1);
+        std::vector<request *> ready;
+        {
+            std::lock_guard<std::mutex> lg(_mux);
+            for (auto& [key, c] : _chats) {
+                if (c._photos.empty() || c._in_flight) {
+                    continue;
+                }
+                auto due = (c._photos.size() >= MEDIA_GROUP_MAX) ?
+                    c._next : std::max(c._first + _coalesce, c._next);
+                if (due > now) {
+                    next = std::min(next, due);
+                    continue;
+                }
+                auto r = idle_request();
+                auto n = std::min(c._photos.size(), MEDIA_GROUP_MAX);
+                r->_key = key;
+                r->_token = c._token;
+                r->_chat_id = c._chat_id;
+                r->_photos.assign(std::make_move_iterator(c._photos.begin()),
+                    std::make_move_iterator(c._photos.begin() + n));
+                c._photos.erase(c._photos.begin(), c._photos.begin() + n);
+                c._first = now;
+                c._next = now + _interval;
+                c._in_flight = true;
+                ready.push_back(r);
+                _stats.requests++;
+            }
+        }
+        for (auto r : ready) {
+            start(r);
+        }
+        return (int)std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+    }
+
+    request *idle_request(void) {
+        for (auto& r : _requests) {
+            if (!r->_active) {
+                return r.get();
+            }
+        }
+        _requests.push_back(std::make_unique<request>());
+        return _requests.back().get();
+    }
+
+    // single photos use sendPhoto, bursts one sendMediaGroup
+    void start(request *r) {
+        if (!r->_easy) {
+            r->_easy = curl_easy_init();
+        }
+        auto easy = r->_easy;
+        r->_active = true;
+        r->_response.clear();
+        r->_mime = curl_mime_init(easy);
+        auto part = curl_mime_addpart(r->_mime);
+        curl_mime_name(part, "chat_id");
+        curl_mime_data(part, r->_chat_id.c_str(), CURL_ZERO_TERMINATED);
+        auto group = r->_photos.size() > 1;
+        if (group) {
+            r->_url = _api + "/bot" + r->_token + "/sendMediaGroup";
+            r->_media = "[";
+            for (size_t i = 0; i < r->_photos.size(); i++) {
+                r->_media += (i ? ",{" : "{");
+                r->_media += "\"type\":\"photo\",\"media\":\"attach://photo" + std::to_string(i) + "\"";
+                if (!i) {
+                    r->_media += ",\"caption\":\"" + escape(r->_photos[i]._caption) + "\"";
+                }
+                r->_media += "}";
+            }
+            r->_media += "]";
+            part = curl_mime_addpart(r->_mime);
+            curl_mime_name(part, "media");
+            curl_mime_data(part, r->_media.c_str(), CURL_ZERO_TERMINATED);
+        } else {
+            r->_url = _api + "/bot" + r->_token + "/sendPhoto";
+            part = curl_mime_addpart(r->_mime);
+            curl_mime_name(part, "caption");
+            curl_mime_data(part, r->_photos[0]._caption.c_str(), CURL_ZERO_TERMINATED);
+        }
+        std::vector<int> params = {cv::IMWRITE_JPEG_QUALITY, _quality};
+        for (size_t i = 0; i < r->_photos.size(); i++) {
+            // curl_mime_data copies, one encode buffer serves every part
+            cv::imencode(".jpg", r->_photos[i]._mat, r->_jpeg, params);
+            auto name = group ? "photo" + std::to_string(i) : std::string("photo");
+            part = curl_mime_addpart(r->_mime);
+            curl_mime_name(part, name.c_str());
+            curl_mime_filename(part, (name + ".jpg").c_str());
+            curl_mime_type(part, "image/jpeg");
+            curl_mime_data(part, (const char *)r->_jpeg.data(), r->_jpeg.size());
+        }
+        curl_easy_setopt(easy, CURLOPT_URL, r->_url.c_str());
+        curl_easy_setopt(easy, CURLOPT_MIMEPOST, r->_mime);
+        curl_easy_setopt(easy, CURLOPT_PRIVATE, r);
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &notifier::write_cbk);
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, &r->_response);
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT, 30L);
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 1L);
+        curl_multi_add_handle(_multi, easy);
+    }
+
+    bool collect(void) {
+        bool finished = false;
+        int left = 0;
+        CURLMsg *m = nullptr;
+        while ((m = curl_multi_info_read(_multi, &left))) {
+            if (m->msg != CURLMSG_DONE) {
+                continue;
+            }
+            auto easy = m->easy_handle;
+            auto result = m->data.result;
+            request *r = nullptr;
+            long code = 0;
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, &r);
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+            curl_multi_remove_handle(_multi, easy);
+            curl_mime_free(r->_mime);
+            r->_mime = nullptr;
+            // keeps the handle (and its connection cache entry) for reuse
+            curl_easy_reset(easy);
+            finish(r, (result == CURLE_OK) ? code : 0, result);
+            finished = true;
+        }
+        return finished;
+    }
+
+    void finish(request *r, long code, CURLcode result) {
+        std::lock_guard<std::mutex> lg(_mux);
+        auto& c = _chats[r->_key];
+        auto n = r->_photos.size();
+        c._in_flight = false;
+        if (code == 200) {
+            // notify is the time from queued to delivered
+            auto now = std::chrono::steady_clock::now();
+            for (const auto& p : r->_photos) {
+                _profile->record(stage::notify, now - p._queued);
+            }
+            _stats.photos += n;
+            _pending -= n;
+        } else if (code == 429) {
+            // too many requests: back off as told and send again
+            int retry = 5;
+            auto at = r->_response.find("\"retry_after\":");
+            if (at != std::string::npos) {
+                retry = std::max(1, std::atoi(r->_response.c_str() + at + 14));
+            }
+            c._next = std::chrono::steady_clock::now() + std::chrono::seconds(retry);
+            c._photos.insert(c._photos.begin(), std::make_move_iterator(r->_photos.begin()),
+                std::make_move_iterator(r->_photos.end()));
+            _stats.throttled++;
+        } else {
+            ERR << "notifier: " << r->_url.substr(0, r->_url.find("/bot") + 4) << "... failed, http "
+                << code << ", " << curl_easy_strerror(result);
+            _stats.failed++;
+            _pending -= n;
+        }
+        r->_photos.clear();
+        r->_active = false;
+        if (_pending == 0) {
+            _idle.notify_all();
+        }
+    }
+};
+
+inline void telegram_notify(const std::vector<cv::Mat>& thumbnails, spcc cc) {
+    if (thumbnails.empty() || cc->_botToken.empty() || cc->_chatids.empty()) {
+        return;
+    }
+    // the sharpest thumbnail
+    size_t idx = 0;
+    double best = -1;
+    for (size_t i = 0; i < thumbnails.size(); i++) {
+        auto score = cvl::geometry::computeLaplacianVariance(thumbnails[i]);
+        if (score > best) {
+            best = score;
+            idx = i;
+        }
+    }
+    notifier::shared()->notify(cc->_botToken, cc->_chatids, thumbnails[idx], "Face Detection Alert");
 }
 
 }
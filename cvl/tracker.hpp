@@ -1,26 +1,54 @@
 #ifndef TRACKER_HPP
 #define TRACKER_HPP
 
+#include <cmath>
 #include <thread>
 #include <vector>
 #include <functional>
 
 #include <geometry.hpp>
 #include <detector.hpp>
+#include <assignment.hpp>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/tracking/tracking.hpp>
+#include <opencv2/tracking/tracking_legacy.hpp>
 
 #include <telegram.hpp>
 
 namespace cvl {
 
+enum class tracker_type : uint8_t {
+    automatic,
+    csrt,
+    kcf,
+    mosse
+};
+
+// how new contexts and detections are handled. boxes under small_area (a
+// fraction of the frame) are small or distant objects where the cheap
+// correlation filters hold up, larger and closer ones get csrt
+struct tracker_policy {
+    tracker_type small = tracker_type::kcf;
+    tracker_type large = tracker_type::csrt;
+    double small_area = 0.01;
+    // a detection continues a track with at least this iou, or with
+    // centroids closer than centroid_gate times the detection diagonal
+    double min_iou = 0.3;
+    double centroid_gate = 0.5;
+    // a continued track overlapping its detection less than this has
+    // drifted and is restarted on the detection
+    double reinit_iou = 0.5;
+    int max_lost = 30;
+};
+
 struct TrackingContext {
     size_t id;
-    bool _tracked;
+    bool _tracked = false;
     int _lostCount = 0;
     int _foundCount = 0;
     bool _notified = false;
+    tracker_type _type = tracker_type::csrt;
     cv::Ptr<cv::Tracker> cvTracker;
     std::vector<cv::Rect2d> _trail;
     std::vector<cv::Mat> _thumbnails;
@@ -30,6 +58,8 @@ struct Tracker {
 
     Tracker() = default;
 
+    Tracker(const tracker_policy& policy) : _policy(policy) {}
+
     ~Tracker() {
         ClearAllContexts();
     }
@@ -42,29 +72,43 @@ struct Tracker {
         return _trackingContexts.size();
     }
 
+    tracker_policy& policy(void) {
+        return _policy;
+    }
+
+    // with tracks alive the detectors only run every _detectInterval
+    // frames, the trackers carry the boxes in between
+    bool detectionDue(spcc cc) const {
+        return _trackingContexts.empty() || cc->_detectInterval <= 1 ||
+            (_frames % cc->_detectInterval) == 0;
+    }
+
     auto updateTrackingContexts(cv::Mat& frame, spcc cc) {
-        for (auto i = _trackingContexts.size() - 1; i >= 0; i--) {
-            auto& t = _trackingContexts[i];
-            cv::Rect bb;
-            t._tracked = false;
-            bool rc = t.cvTracker->update(frame, bb);
-            if (rc && cvl::geometry::isRectInsideMat(bb, frame)) {
-                t._foundCount++;
-                t._tracked = true;
-                t._trail.push_back(bb);
-            } else {
-                t._lostCount++;
-                std::cout << "Tracker " << t.id << " _lostCount: " << t._lostCount << std::endl;
+        _frames++;
+        // each tracker only touches its own context
+        cv::parallel_for_(cv::Range(0, (int)_trackingContexts.size()), [&](const cv::Range& range) {
+            for (int i = range.start; i < range.end; i++) {
+                auto& t = _trackingContexts[i];
+                cv::Rect bb;
+                t._tracked = t.cvTracker->update(frame, bb) &&
+                    cvl::geometry::isRectInsideMat(bb, frame);
+                if (t._tracked) {
+                    t._foundCount++;
+                    t._trail.push_back(bb);
+                } else {
+                    t._lostCount++;
+                }
             }
-            if (t._lostCount >= 30) {
-                auto id = t.id;
-                t.cvTracker.release();
+        });
+        for (auto it = _trackingContexts.begin(); it != _trackingContexts.end(); ) {
+            auto& t = *it;
+            if (t._lostCount >= _policy.max_lost) {
                 if ((cc->_flags & 1) && !t._notified) {
                     t._notified = true;
                     telegram_notify(t._thumbnails, cc);
                 }
-                _trackingContexts.erase(_trackingContexts.begin() + i);
-                std::cout << "-- Tracker with id: " << id << " (frozen)" << std::endl;
+                DBG << "-- Tracker with id: " << t.id << " (frozen)";
+                it = _trackingContexts.erase(it);
                 continue;
             }
             if (t._foundCount > 10 && t._thumbnails.size() > 10) {
@@ -78,34 +122,80 @@ struct Tracker {
                 t._thumbnails.clear();
             if (t._trail.size() > 20)
                 t._trail.erase(t._trail.begin(), t._trail.end() - 1);
+            it++;
         }
     }
 
-    auto matchDetectionWithTrackingContext(const cv::Rect2d& roi, cv::Mat& mat) {
-        for (auto& t : _trackingContexts) {
-            if (t._tracked) {
-                if (cvl::geometry::isSameObject(roi, t._trail.back())) {
-                    t._thumbnails.push_back(mat(roi));
-                    return true;
-                }
+    // minimum cost assignment of the detections to the tracks that are
+    // still tracked, on 1 - iou plus the centroid distance. returns for
+    // each detection whether it continued a track, the others start one
+    auto associate(const Detections& detections, cv::Mat& mat) {
+        std::vector<bool> matched(detections.size(), false);
+        std::vector<size_t> tracks;
+        for (size_t i = 0; i < _trackingContexts.size(); i++) {
+            if (_trackingContexts[i]._tracked) {
+                tracks.push_back(i);
+            }
+        }
+        auto rows = detections.size(), cols = tracks.size();
+        std::vector<double> cost(rows * cols);
+        for (size_t r = 0; r < rows; r++) {
+            for (size_t c = 0; c < cols; c++) {
+                cost[r * cols + c] = matchCost(detections[r],
+                    _trackingContexts[tracks[c]]._trail.back());
             }
         }
-        return false;
+        auto assignment = cvl::hungarian(cost, rows, cols);
+        for (size_t r = 0; r < rows; r++) {
+            const auto& roi = detections[r];
+            auto c = assignment[r];
+            if (c < 0 || !isSameObject(roi, _trackingContexts[tracks[c]]._trail.back())) {
+                addNewTrackingContext(roi, mat);
+                continue;
+            }
+            auto& t = _trackingContexts[tracks[c]];
+            // a crop sized copy: a view would pin the whole pooled frame
+            // and show the boxes drawn on it later
+            t._thumbnails.push_back(mat(roi).clone());
+            if (cvl::geometry::computeIOU(roi, t._trail.back()) < _policy.reinit_iou) {
+                t.cvTracker = createTracker(t._type);
+                t.cvTracker->init(mat, roi);
+                t._trail.push_back(roi);
+            }
+            matched[r] = true;
+        }
+        return matched;
     }
 
-    auto addNewTrackingContext(const cv::Rect2d& roi, const cv::Mat& mat) {
+    auto addNewTrackingContext(const cv::Rect2d& roi, const cv::Mat& mat, tracker_type type = tracker_type::automatic) {
         TrackingContext t;
-        t.id = _trackingContexts.size();
-        cv::TrackerCSRT::Params params;
-        params.psr_threshold = 0.04f; //0.035f;
-        //param.template_size = 150;
-        //param.admm_iterations = 3;
-        t.cvTracker = cv::TrackerCSRT::create(params);
+        t.id = _nextId++;
+        if (type == tracker_type::automatic) {
+            type = (roi.area() < _policy.small_area * mat.total()) ? _policy.small : _policy.large;
+        }
+        t._type = type;
+        t.cvTracker = createTracker(type);
         t._trail.push_back(roi);
         t.cvTracker->init(mat, roi);
         cv::rectangle(mat, roi, cv::Scalar(0, 0, 0 ), 2, 1);
         _trackingContexts.push_back(t);
-        std::cout << "++ Tracker with id: " << t.id << std::endl;
+        DBG << "++ Tracker with id: " << t.id;
+    }
+
+    static cv::Ptr<cv::Tracker> createTracker(tracker_type type) {
+        switch (type) {
+            case tracker_type::kcf:
+                return cv::TrackerKCF::create();
+            case tracker_type::mosse:
+                return cv::legacy::upgradeTrackingAPI(cv::legacy::TrackerMOSSE::create());
+            default: {
+                cv::TrackerCSRT::Params params;
+                params.psr_threshold = 0.04f; //0.035f;
+                //param.template_size = 150;
+                //param.admm_iterations = 3;
+                return cv::TrackerCSRT::create(params);
+            }
+        }
     }
 
     void RenderDisplacementAndPaths(const TrackingContext& t, cv::Mat& mat, int flags) {
@@ -128,7 +218,25 @@ struct Tracker {
 
     protected:
 
+    size_t _nextId = 0;
+    uint64_t _frames = 0;
+    tracker_policy _policy;
     std::vector<TrackingContext> _trackingContexts;
+
+    double matchCost(const cv::Rect2d& detection, const cv::Rect2d& track) const {
+        auto diagonal = std::max(std::hypot(detection.width, detection.height), 1.0);
+        auto d = cvl::geometry::distance(cvl::geometry::getRectCenter(detection),
+            cvl::geometry::getRectCenter(track));
+        return (1.0 - cvl::geometry::computeIOU(detection, track)) + std::min(d / diagonal, 1.0);
+    }
+
+    bool isSameObject(const cv::Rect2d& detection, const cv::Rect2d& track) const {
+        auto diagonal = std::hypot(detection.width, detection.height);
+        auto d = cvl::geometry::distance(cvl::geometry::getRectCenter(detection),
+            cvl::geometry::getRectCenter(track));
+        return cvl::geometry::isSameObject(track, detection, _policy.min_iou) ||
+            d < _policy.centroid_gate * diagonal;
+    }
 };
 
 } //namespace cvl
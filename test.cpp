@@ -6,6 +6,16 @@
 #include <npl/npl>
 #include <cvl/cvl>
 #include <osl/lcs>
+#include <osl/cache>
+#include <fxc/vd/vd>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
 
 #include "gtest/gtest.h"
 
@@ -72,4 +82,1187 @@ TEST_F(DispatcherFixture, Construction) {
     ASSERT_EQ(d->has_control_initialized(), true);
 }
 
+TEST(ListParser, SplitChunks) {
+    std::vector<std::string> names;
+    std::vector<uint64_t> sizes;
+    npl::list_parser parser(npl::list_format::mlsd, [&](const npl::list_entry& e) {
+        names.emplace_back(e.name);
+        sizes.push_back(e.size);
+    });
+    std::string list =
+        "type=cdir;modify=20221015170330.792;perms=cple; .\r\n"
+        "type=file;size=8192;modify=20221219022112.389;perms=awr; Dump Stack.log\r\n"
+        "type=dir;modify=20221015170330.792;perms=cple; Intel";
+    for (size_t i = 0; i < list.size(); i += 7) {
+        parser.feed(list.data() + i, std::min<size_t>(7, list.size() - i));
+    }
+    parser.finish();
+    ASSERT_EQ(names.size(), 2);
+    ASSERT_EQ(names[0], "Dump Stack.log");
+    ASSERT_EQ(sizes[0], 8192);
+    ASSERT_EQ(names[1], "Intel");
+    ASSERT_EQ(parser.folder_count(), 1);
+}
+
+TEST(ListParser, UnixAndWindows) {
+    npl::list_entry e;
+    npl::list_parser parser(npl::list_format::list_unix, {});
+    ASSERT_TRUE(parser.parse_unix("-rw-rw-rw- 1 ftp    ftp       1468320 Oct 15  2021 a b c", e));
+    ASSERT_EQ(e.name, "a b c");
+    ASSERT_EQ(e.size, 1468320);
+    ASSERT_EQ(e.timestamp, npl::list_parser::to_epoch(2021, 10, 15, 0, 0, 0));
+    ASSERT_TRUE(npl::list_parser::parse_windows("10-15-22  05:37PM       <DIR>          Intel", e));
+    ASSERT_TRUE(e.is_dir);
+    ASSERT_EQ(e.timestamp, npl::list_parser::to_epoch(2022, 10, 15, 17, 37, 0));
+}
+
+TEST(LruCache, EvictionAndExpiry) {
+    osl::lru_cache<std::string, int> cache(2, std::chrono::milliseconds(20));
+    int v = 0;
+    cache.put("/a", 1);
+    cache.put("/b", 2);
+    ASSERT_EQ(cache.get("/a", v), decltype(cache)::lookup::fresh);
+    cache.put("/c", 3);
+    ASSERT_EQ(cache.get("/b", v), decltype(cache)::lookup::miss);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    ASSERT_EQ(cache.get("/a", v), decltype(cache)::lookup::stale);
+    ASSERT_EQ(v, 1);
+    cache.touch("/a");
+    ASSERT_EQ(cache.get("/a", v), decltype(cache)::lookup::fresh);
+    ASSERT_EQ(cache.erase_if([](const auto& k) { return k.starts_with("/c"); }), 1);
+    ASSERT_EQ(cache.size(), 1);
+}
+
+TEST(FrameQueue, DropOldest) {
+    cvl::queue<int, 3> q;
+    for (int i = 1; i <= 5; i++) {
+        q.enqueue(i);
+    }
+    ASSERT_EQ(q.dropped(), 2);
+    ASSERT_EQ(q.dequeue(), 3);
+    ASSERT_EQ(q.dequeue(), 4);
+    ASSERT_EQ(q.dequeue(), 5);
+    int v = 0;
+    ASSERT_FALSE(q.wait_dequeue(v, std::chrono::milliseconds(10)));
+}
+
+// moving out of a slot stalls on the consumer, which holds its claim on the
+// oldest element meanwhile
+struct slow_move {
+    int v = 0;
+    static inline thread_local bool slow = false;
+    slow_move() {}
+    slow_move(int v) : v(v) {}
+    slow_move(slow_move&& o) : v(o.v) {}
+    slow_move& operator=(slow_move&& o) {
+        if (slow) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        v = o.v;
+        return *this;
+    }
+};
+
+TEST(FrameQueue, FullRingWhileConsumerPops) {
+    cvl::queue<slow_move, 4> q;
+    for (int i = 1; i <= 4; i++) {
+        q.enqueue(slow_move(i));
+    }
+    int first = 0;
+    std::thread consumer([&]() {
+        slow_move::slow = true;
+        first = q.dequeue().v;
+    });
+    while (q.size() == 4) {
+        std::this_thread::yield();
+    }
+    // the slot being moved out of frees up, nothing else is dropped
+    EXPECT_TRUE(q.enqueue(slow_move(5)));
+    consumer.join();
+    ASSERT_EQ(first, 1);
+    ASSERT_EQ(q.dropped(), 0);
+    for (int i = 2; i <= 5; i++) {
+        ASSERT_EQ(q.dequeue().v, i);
+    }
+    // full again, one enqueue drops one element
+    for (int i = 6; i <= 10; i++) {
+        q.enqueue(slow_move(i));
+    }
+    ASSERT_EQ(q.dropped(), 1);
+    ASSERT_EQ(q.dequeue().v, 7);
+}
+
+TEST(FrameQueue, PooledBuffersAreRecycled) {
+    cvl::mat_pool pool(2);
+    auto a = pool.acquire(cv::Size(64, 64), CV_8UC3);
+    auto data = a.data;
+    cvl::queue<cv::Mat, 2> q;
+    q.enqueue(std::move(a));
+    auto b = q.dequeue();
+    ASSERT_EQ(b.data, data);
+    b.release();
+    ASSERT_EQ(pool.acquire(cv::Size(64, 64), CV_8UC3).data, data);
+    ASSERT_EQ(pool.allocations(), 1);
+}
+
+TEST(Hungarian, MinimumCostAssignment) {
+    // greedy would take (0,0) = 1 and then pay 9 for (1,1)
+    std::vector<double> cost = {
+        1, 2,
+        3, 9,
+        5, 6
+    };
+    auto a = cvl::hungarian(cost, 3, 2);
+    ASSERT_EQ(a.size(), 3);
+    EXPECT_EQ(a[0], 1);
+    EXPECT_EQ(a[1], 0);
+    EXPECT_EQ(a[2], -1);
+    EXPECT_TRUE(cvl::hungarian({}, 0, 4).empty());
+}
+
+TEST(HnswIndex, NearestSurvivesSaveAndLoad) {
+    const size_t dim = 16, count = 2000;
+    std::mt19937 rng(7);
+    std::normal_distribution<float> normal;
+    std::vector<float> data(dim * count);
+    for (auto& f : data) {
+        f = normal(rng);
+    }
+    cvl::hnsw_index index(dim, 8, 64);
+    for (size_t i = 0; i < count; i++) {
+        index.add((int)i, &data[i * dim]);
+    }
+    int found = 0;
+    for (size_t i = 0; i < count; i += 10) {
+        auto r = index.search(&data[i * dim], 1);
+        found += r.size() && r[0].second == (int)i;
+    }
+    EXPECT_GE(found, 195);
+    std::stringstream ss;
+    ASSERT_TRUE(index.save(ss));
+    cvl::hnsw_index loaded;
+    ASSERT_TRUE(loaded.load(ss));
+    ASSERT_EQ(loaded.size(), count);
+    for (size_t i = 0; i < count; i += 97) {
+        EXPECT_EQ(loaded.search(&data[i * dim], 3), index.search(&data[i * dim], 3));
+    }
+    std::stringstream truncated(ss.str().substr(0, 100));
+    EXPECT_FALSE(loaded.load(truncated));
+    EXPECT_EQ(loaded.size(), 0);
+    // a node count past the file, an entry past the nodes, a link past them
+    size_t first_link = 6 * 8 + count * 4 + count * dim * 4 + 8;
+    for (auto [at, value] : std::vector<std::pair<size_t, uint64_t>>{{24, 1ULL << 40}, {32, count}, {first_link, 0xFFFFFF}}) {
+        auto bytes = ss.str();
+        memcpy(bytes.data() + at, &value, at == first_link ? 4 : 8);
+        std::stringstream corrupt(bytes);
+        EXPECT_FALSE(loaded.load(corrupt));
+        EXPECT_EQ(loaded.size(), 0);
+    }
+}
+
+TEST(Profiler, HistogramsAndExposition) {
+    auto profile = cvl::profiler::shared().add("test_cam");
+    for (int i = 0; i < 9; i++) {
+        profile->record(cvl::stage::face, std::chrono::microseconds(3));
+    }
+    profile->record(cvl::stage::face, std::chrono::milliseconds(5));
+    profile->set(cvl::gauge::queue_in, 2);
+    auto s = profile->snapshot();
+    const auto& face = s.stages[(size_t)cvl::stage::face];
+    ASSERT_EQ(face.count, 10);
+    EXPECT_EQ(face.buckets[2], 9);
+    EXPECT_DOUBLE_EQ(face.quantile_ms(0.5), 0.004);
+    EXPECT_DOUBLE_EQ(face.quantile_ms(0.99), 8.192);
+    EXPECT_EQ(s.stages[(size_t)cvl::stage::object].count, 0);
+    auto text = cvl::profiler::shared().prometheus();
+    EXPECT_NE(text.find("cvl_stage_seconds_count{camera=\"test_cam\",stage=\"face\"} 10"), std::string::npos);
+    EXPECT_NE(text.find("cvl_queue_in_depth{camera=\"test_cam\"} 2"), std::string::npos);
+    EXPECT_EQ(text.find("stage=\"object\""), std::string::npos);
+}
+
+TEST(EncoderPool, BlockingPolicyWritesEverySnapshot) {
+    auto folder = std::filesystem::temp_directory_path() / "cvl_test_snapshots";
+    std::filesystem::create_directories(folder);
+    {
+        cvl::encoder_pool pool(2, 4, 3, 80, cvl::drop_policy::block);
+        for (int i = 0; i < 20; i++) {
+            ASSERT_TRUE(pool.submit(cv::Mat(32, 32, CV_8UC3, cv::Scalar(i, i, i)),
+                (folder / std::to_string(i)).string()));
+        }
+        pool.flush();
+        auto stats = pool.stats();
+        ASSERT_EQ(stats.written, 20);
+        ASSERT_EQ(stats.dropped, 0);
+        ASSERT_LE(stats.peak_queued, 4);
+    }
+    ASSERT_TRUE(std::filesystem::exists(folder / "19.jpg"));
+    std::filesystem::remove_all(folder);
+}
+
+#ifndef _WIN32
+
+// answers bot api calls with {"ok":true} over keep-alive connections and
+// records "method:photos" for every request. the first `throttle` requests
+// get a 429 with retry_after 1
+struct bot_api_standin {
+
+    bot_api_standin(int throttle = 0) : _throttle(throttle) {
+        _fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in sa = {};
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(_fd, (sockaddr *)&sa, sizeof(sa));
+        socklen_t len = sizeof(sa);
+        getsockname(_fd, (sockaddr *)&sa, &len);
+        _port = ntohs(sa.sin_port);
+        listen(_fd, 4);
+        _thread = std::thread([this](){ serve(); });
+    }
+
+    ~bot_api_standin() {
+        shutdown(_fd, SHUT_RDWR);
+        close(_fd);
+        _thread.join();
+    }
+
+    std::string url(void) {
+        return "http://127.0.0.1:" + std::to_string(_port);
+    }
+
+    std::vector<std::string> calls(void) {
+        std::lock_guard<std::mutex> lg(_mux);
+        return _calls;
+    }
+
+    int connections(void) {
+        return _connections;
+    }
+
+    private:
+
+    int _fd = -1;
+    int _port = 0;
+    int _throttle = 0;
+    std::mutex _mux;
+    std::thread _thread;
+    std::atomic<int> _connections{0};
+    std::vector<std::string> _calls;
+
+    void serve(void) {
+        int c;
+        while ((c = accept(_fd, nullptr, nullptr)) >= 0) {
+            _connections++;
+            std::string in;
+            char b[4096];
+            ssize_t n;
+            while ((n = recv(c, b, sizeof(b), 0)) > 0) {
+                in.append(b, n);
+                while (respond(c, in)) {}
+            }
+            close(c);
+        }
+    }
+
+    // consumes one complete request from in, if there is one
+    bool respond(int c, std::string& in) {
+        auto end = in.find("\r\n\r\n");
+        if (end == std::string::npos) return false;
+        auto head = in.substr(0, end);
+        size_t length = 0;
+        auto cl = head.find("Content-Length: ");
+        if (cl != std::string::npos) {
+            length = std::stoul(head.substr(cl + 16));
+        }
+        if (head.find("Expect: 100-continue") != std::string::npos && in.size() == end + 4) {
+            std::string go = "HTTP/1.1 100 Continue\r\n\r\n";
+            send(c, go.data(), go.size(), 0);
+            in.replace(head.find("Expect: 100-continue"), 20, "Expect: done");
+            return false;
+        }
+        if (in.size() < end + 4 + length) return false;
+        auto body = in.substr(end + 4, length);
+        in.erase(0, end + 4 + length);
+        auto path = head.substr(head.find(' ') + 1);
+        path = path.substr(0, path.find(' '));
+        auto method = path.substr(path.rfind('/') + 1);
+        size_t photos = 0;
+        for (auto at = body.find("filename="); at != std::string::npos; at = body.find("filename=", at + 1)) {
+            photos++;
+        }
+        auto call = method + ":" + std::to_string(photos);
+        std::string reply = "{\"ok\":true}", status = "200 OK";
+        if (_throttle > 0) {
+            _throttle--;
+            reply = "{\"ok\":false,\"error_code\":429,\"parameters\":{\"retry_after\":1}}";
+            status = "429 Too Many Requests";
+            call += ":429";
+        }
+        {
+            std::lock_guard<std::mutex> lg(_mux);
+            _calls.push_back(call);
+        }
+        auto out = "HTTP/1.1 " + status + "\r\nContent-Type: application/json\r\nContent-Length: " +
+            std::to_string(reply.size()) + "\r\n\r\n" + reply;
+        send(c, out.data(), out.size(), 0);
+        return true;
+    }
+};
+
+TEST(Notifier, CoalescesBurstsOverOneConnection) {
+    bot_api_standin api;
+    {
+        cvl::notifier n(api.url(), 16, std::chrono::milliseconds(300), std::chrono::milliseconds(100));
+        cv::Mat photo(48, 48, CV_8UC3, cv::Scalar(0, 128, 255));
+        for (int i = 0; i < 3; i++) {
+            ASSERT_TRUE(n.notify("token", "42", photo, "burst"));
+        }
+        ASSERT_TRUE(n.flush(std::chrono::seconds(5)));
+        ASSERT_TRUE(n.notify("token", "42", photo, "single"));
+        ASSERT_TRUE(n.flush(std::chrono::seconds(5)));
+        auto stats = n.stats();
+        ASSERT_EQ(stats.requests, 2);
+        ASSERT_EQ(stats.photos, 4);
+    }
+    auto calls = api.calls();
+    ASSERT_EQ(calls.size(), 2);
+    EXPECT_EQ(calls[0], "sendMediaGroup:3");
+    EXPECT_EQ(calls[1], "sendPhoto:1");
+    EXPECT_EQ(api.connections(), 1);
+}
+
+TEST(Notifier, DropsWhenFullAndBacksOffOnTooManyRequests) {
+    bot_api_standin api(1);
+    cvl::notifier n(api.url(), 2, std::chrono::milliseconds(100), std::chrono::milliseconds(50));
+    cv::Mat photo(16, 16, CV_8UC3, cv::Scalar(255, 0, 0));
+    ASSERT_TRUE(n.notify("token", "7", photo, "a"));
+    ASSERT_TRUE(n.notify("token", "7", photo, "b"));
+    ASSERT_FALSE(n.notify("token", "7", photo, "c"));
+    ASSERT_TRUE(n.flush(std::chrono::seconds(5)));
+    auto stats = n.stats();
+    ASSERT_EQ(stats.dropped, 1);
+    ASSERT_EQ(stats.throttled, 1);
+    ASSERT_EQ(stats.photos, 2);
+    auto calls = api.calls();
+    ASSERT_EQ(calls.size(), 2);
+    EXPECT_EQ(calls[0], "sendMediaGroup:2:429");
+    EXPECT_EQ(calls[1], "sendMediaGroup:2");
+}
+
+// a folder of its own under the temp directory, so tests may run side by
+// side, removed with everything in it however the test ends
+struct scratch_folder {
+
+    explicit scratch_folder(const std::string& name) {
+        auto t = (std::filesystem::temp_directory_path() / ("fxc_" + name + "_XXXXXX")).string();
+        if (mkdtemp(t.data())) {
+            _path = t;
+        }
+    }
+
+    ~scratch_folder() {
+        std::error_code ec;
+        if (!_path.empty()) {
+            std::filesystem::remove_all(_path, ec);
+        }
+    }
+
+    scratch_folder(const scratch_folder&) = delete;
+    scratch_folder& operator=(const scratch_folder&) = delete;
+
+    bool ok(void) const {
+        return !_path.empty();
+    }
+
+    std::filesystem::path operator/(const std::filesystem::path& p) const {
+        return _path / p;
+    }
+
+    private:
+
+    std::filesystem::path _path;
+};
+
+static std::vector<uint8_t> random_bytes(size_t n, uint32_t seed) {
+    std::vector<uint8_t> v(n);
+    std::mt19937 rng(seed);
+    for (auto& b : v) {
+        b = (uint8_t)rng();
+    }
+    return v;
+}
+
+// b over the file at o, the way a change or a corruption lands
+static bool patch_file(const std::filesystem::path& path, const void *b, size_t l, uint64_t o) {
+    auto fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = pwrite(fd, b, l, o) == (ssize_t)l;
+    close(fd);
+    return ok;
+}
+
+// a volume of data.size() bytes, the ranges of data at their own offsets and
+// holes elsewhere, all of it when there are none
+static bool make_volume(const std::filesystem::path& path, const std::vector<uint8_t>& data,
+        std::vector<std::pair<uint64_t, uint64_t>> ranges = {}) {
+    auto fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ftruncate(fd, data.size()) == 0;
+    close(fd);
+    if (ranges.empty()) {
+        ranges.push_back({0, data.size()});
+    }
+    for (auto [off, len] : ranges) {
+        ok = ok && patch_file(path, data.data() + off, len, off);
+    }
+    return ok;
+}
+
+// descriptors this process still has on path, renamed over or not
+static size_t open_handles(const std::filesystem::path& path) {
+    size_t n = 0;
+    for (auto& e : std::filesystem::directory_iterator("/proc/self/fd")) {
+        std::error_code ec;
+        auto target = std::filesystem::read_symlink(e.path(), ec).string();
+        n += !ec && target.rfind(path.string(), 0) == 0;
+    }
+    return n;
+}
+
+TEST(VirtualDisk, SparseFileRoundTrips) {
+    scratch_folder folder("sparse");
+    ASSERT_TRUE(folder.ok());
+    auto volume = folder / "volume.img";
+    uint64_t length = 16 * _1M + _4K;
+    std::vector<uint8_t> expected(length, 0);
+    std::vector<std::pair<uint64_t, uint64_t>> written;
+    for (uint64_t off : std::vector<uint64_t>{0, 5 * _1M + _4K, length - _4K}) {
+        for (uint64_t i = off; i < off + _4K; i++) {
+            expected[i] = (uint8_t)(i * 31 + 7);
+        }
+        written.push_back({off, _4K});
+    }
+    ASSERT_TRUE(make_volume(volume, expected, written));
+    auto source = fxc::make_block_source(volume.wstring());
+    ASSERT_TRUE(source);
+    uint64_t used = 0;
+    for (uint64_t c = 0; c < source->clusters(); c++) {
+        used += source->in_use(c);
+    }
+    EXPECT_LE(used, 3);
+    for (auto format : {L"d-vhd", L"d-vhdx"}) {
+        auto image = folder / (std::wstring(L"volume.") + format);
+        fxc::createBaseVirtualDiskFromSource(format, volume.wstring(),
+            npl::make_file(image.wstring(), true), nullptr);
+        auto disk = fxc::get_virtual_disk(image.wstring());
+        ASSERT_TRUE(disk);
+        std::vector<uint8_t> actual(length);
+        ASSERT_EQ(disk->read_sync(actual.data(), length, disk->getPartitionStartOffset(0)), (int32_t)length);
+        EXPECT_TRUE(actual == expected);
+        disk.reset();
+    }
+    // holes never reach the dynamic image
+    EXPECT_LT(std::filesystem::file_size(folder / "volume.d-vhd"), length);
+}
+
+TEST(VirtualDisk, DifferencingChainReadsFlattened) {
+    scratch_folder folder("chain");
+    ASSERT_TRUE(folder.ok());
+    auto volume = folder / "volume.img";
+    std::vector<uint8_t> data(8 * _1M, 0);
+    memset(data.data() + _2M + _4K, 0x5A, _4K);
+    ASSERT_TRUE(make_volume(volume, data, {{_2M + _4K, _4K}}));
+    auto parent = folder / "level0.vhd";
+    fxc::createBaseVirtualDiskFromSource(L"d-vhd", volume.wstring(),
+        npl::make_file(parent.wstring(), true), nullptr);
+    auto base = fxc::get_virtual_disk(parent.wstring());
+    ASSERT_TRUE(base);
+    std::vector<uint8_t> expected(base->getLogicalDiskLength());
+    ASSERT_EQ(base->read_sync(expected.data(), expected.size(), 0), (int32_t)expected.size());
+    base.reset();
+    // each level overwrites a few sectors, some of them straddling the last one's
+    for (uint64_t level = 1; level <= 3; level++) {
+        std::map<uint64_t, std::vector<fxc::DataBlockIO>> changes;
+        for (uint64_t off : std::vector<uint64_t>{_2M + _4K + (level * 1024), (level * 2 + 1) * _1M}) {
+            memset(expected.data() + off, (int)level, _4K);
+            changes[off / _2M].push_back({_4K, off, nullptr});
+        }
+        auto child = folder / ("level" + std::to_string(level) + ".vhd");
+        ASSERT_TRUE(fxc::write_child_vhd(parent.wstring(), npl::make_file(child.wstring(), true), changes,
+            [&](uint8_t *b, size_t l, uint64_t o) {
+                memcpy(b, expected.data() + o, l);
+                return (int32_t)l;
+            }));
+        parent = child;
+    }
+    auto leaf = fxc::get_virtual_disk(parent.wstring());
+    ASSERT_TRUE(leaf);
+    EXPECT_EQ(leaf->getChain().size(), 4);
+    std::vector<uint8_t> actual(expected.size());
+    for (auto flatten : {false, true, true}) {
+        leaf->iFlatten = flatten;
+        memset(actual.data(), 0xFF, actual.size());
+        ASSERT_EQ(leaf->read_sync(actual.data(), actual.size(), 0), (int32_t)actual.size());
+        EXPECT_TRUE(actual == expected);
+    }
+    // the second flattened pass came from the map
+    EXPECT_GT(leaf->getBlockMap().hits(), 0);
+    EXPECT_TRUE(leaf->saveBlockMap());
+    leaf.reset();
+    leaf = fxc::get_virtual_disk(parent.wstring());
+    memset(actual.data(), 0xFF, actual.size());
+    ASSERT_EQ(leaf->read_sync(actual.data(), actual.size(), 0), (int32_t)actual.size());
+    EXPECT_TRUE(actual == expected);
+    EXPECT_EQ(leaf->getBlockMap().misses(), 0);
+    // a map with the first run's layer past the chain, then its count past the
+    // block, is rebuilt rather than read through
+    auto bmap = leaf->getBlockMapPath();
+    for (auto [at, value] : std::vector<std::pair<off_t, uint32_t>>{{108, 7}, {104, 5000}}) {
+        leaf->close();
+        leaf.reset();
+        ASSERT_TRUE(patch_file(bmap, &value, sizeof(value), at));
+        leaf = fxc::get_virtual_disk(parent.wstring());
+        memset(actual.data(), 0xFF, actual.size());
+        ASSERT_EQ(leaf->read_sync(actual.data(), actual.size(), 0), (int32_t)actual.size());
+        EXPECT_TRUE(actual == expected);
+        EXPECT_GT(leaf->getBlockMap().misses(), 0);
+        EXPECT_TRUE(leaf->saveBlockMap());
+    }
+    // a leaf cut after its first sector bitmap fails reads and merges, flattened
+    // or not, instead of reading through to the parent
+    auto cut = std::dynamic_pointer_cast<fxc::vhd>(leaf)->firstDataBlockOffset() + 512;
+    leaf->close();
+    leaf.reset();
+    std::filesystem::resize_file(parent, cut);
+    for (auto flatten : {true, false}) {
+        leaf = fxc::get_virtual_disk(parent.wstring());
+        ASSERT_TRUE(leaf);
+        leaf->iFlatten = flatten;
+        EXPECT_EQ(leaf->read_sync(actual.data(), _4K, 7 * _1M), -1);
+        EXPECT_EQ(leaf->read_sync(actual.data(), actual.size(), 0), -1);
+        leaf->close();
+        leaf.reset();
+    }
+    EXPECT_FALSE(fxc::merge_virtual_disk(parent.wstring(), 0, 2));
+    EXPECT_EQ(std::filesystem::file_size(parent), cut);
+}
+
+TEST(VirtualDisk, LongParentPathStaysInItsHeaderFields) {
+    fxc::vhd base(64 * _1M, _2M, format::dynamic, nullptr);
+    base.iPath = L"/" + std::wstring(163, L'p');
+    fxc::vhd child(64 * _1M, _2M, format::differencing, &base);
+    auto& h = child.iHeader;
+    EXPECT_EQ(Utf16ToWString(h.ParentName + 1, sizeof(h.ParentName) - 2), base.iPath.wstring());
+    EXPECT_EQ(osl::endian_reverse(*((uint32_t *)&h.ParentLocatorTable[0].PlatformDataLength)), 164 * 2);
+    EXPECT_EQ(osl::endian_reverse(*((uint32_t *)&h.ParentLocatorTable[1].PlatformDataLength)),
+        (uint32_t)(std::wstring(L".\\").size() + 163) * 2);
+    for (int i = 2; i < 8; i++) {
+        auto& ple = h.ParentLocatorTable[i];
+        EXPECT_EQ(std::count((uint8_t *)&ple, (uint8_t *)&ple + sizeof(ple), 0), (long)sizeof(ple));
+    }
+    // past the name a path is cut, leaving a terminator
+    base.iPath = L"/" + std::wstring(600, L'p');
+    fxc::vhd deep(64 * _1M, _2M, format::differencing, &base);
+    EXPECT_EQ(Utf16ToWString(deep.iHeader.ParentName + 1, sizeof(h.ParentName) - 2).size(), 255);
+    EXPECT_EQ(osl::endian_reverse(*((uint32_t *)&deep.iHeader.ParentLocatorTable[2].PlatformDataLength)), 0);
+}
+
+TEST(VirtualDisk, DedupSkipsZeroesAndRehydrates) {
+    scratch_folder folder("dedup");
+    ASSERT_TRUE(folder.ok());
+    auto volume = folder / "volume.img";
+    uint64_t length = 16 * _1M;
+    std::vector<uint8_t> expected(length, 0);
+    auto random = random_bytes(_2M, 9);
+    memcpy(expected.data(), random.data(), _2M);
+    // the same data again off alignment, and a block written with zeroes
+    memcpy(expected.data() + 5 * _1M + 777, expected.data(), _2M);
+    ASSERT_TRUE(make_volume(volume, expected, {{0, 8 * _1M}, {10 * _1M, _2M}}));
+    auto store = std::make_shared<fxc::chunk_store>(folder / "store");
+    auto backup = std::make_shared<fxc::manifest>();
+    fxc::dedup_stats stats;
+    ASSERT_TRUE(fxc::dedup_backup(fxc::make_block_source(volume.wstring()), *store, *backup, {}, &stats));
+    EXPECT_GE(stats.zero, _2M);
+    EXPECT_GT(stats.ratio(), 1.5);
+    ASSERT_TRUE(backup->save(folder / "backup.mnf"));
+    auto loaded = std::make_shared<fxc::manifest>();
+    ASSERT_TRUE(loaded->load(folder / "backup.mnf"));
+    auto image = folder / "rehydrated.vhd";
+    fxc::createBaseVirtualDiskFromSource(L"d-vhd", std::make_shared<fxc::manifest_source>(loaded, store),
+        L"backup", npl::make_file(image.wstring(), true), nullptr);
+    auto disk = fxc::get_virtual_disk(image.wstring());
+    ASSERT_TRUE(disk);
+    std::vector<uint8_t> actual(length);
+    ASSERT_EQ(disk->read_sync(actual.data(), length, disk->getPartitionStartOffset(0)), (int32_t)length);
+    EXPECT_TRUE(actual == expected);
+    disk.reset();
+    // zero blocks stay out of an image made straight from the volume too
+    fxc::copy_options options;
+    std::vector<uint64_t> sizes;
+    for (auto skip : {false, true}) {
+        options.skip_zero = skip;
+        auto direct = folder / "direct.vhd";
+        fxc::createBaseVirtualDiskFromSource(L"d-vhd", volume.wstring(), npl::make_file(direct.wstring(), true), nullptr, options);
+        sizes.push_back(std::filesystem::file_size(direct));
+    }
+    EXPECT_LT(sizes[1], sizes[0]);
+    // a store that cannot take its chunks fails the backup
+    auto full = fxc::chunk_store(folder / "full");
+    std::filesystem::remove_all(folder / "full" / "chunks");
+    std::ofstream(folder / "full" / "chunks") << "in the way";
+    fxc::manifest partial;
+    EXPECT_FALSE(fxc::dedup_backup(fxc::make_block_source(volume.wstring()), full, partial));
+    EXPECT_TRUE(std::filesystem::is_regular_file(folder / "full" / "chunks"));
+}
+
+TEST(VirtualDisk, ContainerRoundTripsCompressedAndEncrypted) {
+    scratch_folder folder("container");
+    ASSERT_TRUE(folder.ok());
+    auto volume = folder / "volume.img";
+    uint64_t length = 16 * _1M + 4096;
+    std::vector<uint8_t> expected(length, 0);
+    std::mt19937 rng(11);
+    for (uint64_t i = 0; i < 4 * _1M; i++) {
+        expected[i] = (uint8_t)rng();
+    }
+    // text like data that deflates, and a tail past the last full block
+    for (uint64_t i = 4 * _1M; i < 8 * _1M; i++) {
+        expected[i] = "offset backup "[i % 14] + (uint8_t)(rng() % 2);
+    }
+    memset(expected.data() + 16 * _1M, 0x5A, 4096);
+    ASSERT_TRUE(make_volume(volume, expected, {{0, 10 * _1M}, {16 * _1M, 4096}}));
+    auto image = folder / "volume.c.fxc";
+    fxc::container_options coptions;
+    coptions.passphrase = "correct horse";
+    coptions.iterations = 1000;
+    fxc::createBaseVirtualDiskFromSource(L"c-fxc", volume.wstring(),
+        npl::make_file(image.wstring(), true), nullptr, {}, coptions);
+    EXPECT_LT(std::filesystem::file_size(image), 7 * _1M);
+    EXPECT_FALSE(fxc::get_virtual_disk(image.wstring()));
+    EXPECT_FALSE(fxc::get_virtual_disk(image.wstring(), "wrong horse"));
+    auto disk = fxc::get_virtual_disk(image.wstring(), coptions.passphrase);
+    ASSERT_TRUE(disk);
+    std::vector<uint8_t> actual(length);
+    ASSERT_EQ(disk->read_sync(actual.data(), length, disk->getPartitionStartOffset(0)), (int32_t)length);
+    EXPECT_TRUE(actual == expected);
+    // a flipped bit in a sealed block fails the read instead of returning it
+    auto offset = std::dynamic_pointer_cast<fxc::container>(disk)->iIndex[1].Offset;
+    disk.reset();
+    auto fd = open(image.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    uint8_t byte = 0;
+    ASSERT_EQ(pread(fd, &byte, 1, offset + 100), 1);
+    byte ^= 0x01;
+    ASSERT_EQ(pwrite(fd, &byte, 1, offset + 100), 1);
+    close(fd);
+    disk = fxc::get_virtual_disk(image.wstring(), coptions.passphrase);
+    ASSERT_TRUE(disk);
+    EXPECT_EQ(disk->read_sync(actual.data(), _1M, disk->getPartitionStartOffset(0)), -1);
+    // index edits behind a recomputed crc fail the index tag
+    auto c = std::dynamic_pointer_cast<fxc::container>(disk);
+    auto index = c->iIndex;
+    auto trailer = c->iTrailer;
+    auto pstart = disk->getPartitionStartOffset(0);
+    c.reset();
+    disk.reset();
+    auto rewrite = [&](std::vector<FXC_CONTAINER_ENTRY> entries) {
+        auto t = trailer;
+        auto len = entries.size() * sizeof(FXC_CONTAINER_ENTRY);
+        t.IndexCrc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)entries.data(), (uInt)len);
+        return patch_file(image, entries.data(), len, t.IndexOffset) &&
+            patch_file(image, &t, sizeof(t), t.IndexOffset + len);
+    };
+    auto swapped = index;
+    std::swap(swapped[2].Offset, swapped[3].Offset);
+    ASSERT_TRUE(rewrite(swapped));
+    EXPECT_FALSE(fxc::get_virtual_disk(image.wstring(), coptions.passphrase));
+    auto dropped = index;
+    dropped[2].State = FXC_BLOCK_ABSENT;
+    ASSERT_TRUE(rewrite(dropped));
+    EXPECT_FALSE(fxc::get_virtual_disk(image.wstring(), coptions.passphrase));
+    // blocks swapped in place fail their own tags
+    ASSERT_TRUE(rewrite(index));
+    ASSERT_EQ(index[2].Length, index[3].Length);
+    std::vector<uint8_t> b2(index[2].Length), b3(index[3].Length);
+    fd = open(image.c_str(), O_RDWR);
+    ASSERT_EQ(pread(fd, b2.data(), b2.size(), index[2].Offset), (ssize_t)b2.size());
+    ASSERT_EQ(pread(fd, b3.data(), b3.size(), index[3].Offset), (ssize_t)b3.size());
+    ASSERT_EQ(pwrite(fd, b3.data(), b3.size(), index[2].Offset), (ssize_t)b3.size());
+    ASSERT_EQ(pwrite(fd, b2.data(), b2.size(), index[3].Offset), (ssize_t)b2.size());
+    close(fd);
+    disk = fxc::get_virtual_disk(image.wstring(), coptions.passphrase);
+    ASSERT_TRUE(disk);
+    EXPECT_EQ(disk->read_sync(actual.data(), _1M, pstart + _1M), -1);
+    EXPECT_EQ(disk->read_sync(actual.data(), _1M, pstart + 2 * _1M), -1);
+    EXPECT_EQ(disk->read_sync(actual.data(), _1M, pstart + 3 * _1M), (int32_t)_1M);
+    disk.reset();
+}
+
+TEST(VirtualDisk, VerifyFindsFlippedBits) {
+    scratch_folder folder("verify");
+    ASSERT_TRUE(folder.ok());
+    auto volume = folder / "volume.img";
+    uint64_t length = 16 * _1M + _4K;
+    auto data = random_bytes(length, 3);
+    ASSERT_TRUE(make_volume(volume, data));
+    auto flip = [](const std::filesystem::path& path, uint64_t offset) {
+        auto fd = open(path.c_str(), O_RDWR);
+        uint8_t byte = 0;
+        bool ok = fd >= 0 && pread(fd, &byte, 1, offset) == 1;
+        byte ^= 0x10;
+        ok = ok && pwrite(fd, &byte, 1, offset) == 1;
+        close(fd);
+        return ok;
+    };
+    for (auto format : {L"d-vhd", L"d-vhdx"}) {
+        auto image = folder / (std::wstring(L"volume.") + format);
+        fxc::copy_options options;
+        options.manifest = image.wstring() + L".crc";
+        fxc::createBaseVirtualDiskFromSource(format, volume.wstring(),
+            npl::make_file(image.wstring(), true), nullptr, options);
+        fxc::verify_options voptions;
+        voptions.threads = 3;
+        voptions.manifest = options.manifest;
+        voptions.source = fxc::make_block_source(volume.wstring());
+        auto report = fxc::verify_virtual_disk(image.wstring(), voptions);
+        EXPECT_TRUE(report.ok());
+        EXPECT_GT(report.blocks, 5);
+        EXPECT_EQ(report.sums.entries().size(), report.blocks);
+        // file offsets of block 2's payload and of block 3's bat entry
+        uint64_t payload = 0, entry = 0;
+        {
+            auto disk = fxc::get_virtual_disk(image.wstring());
+            ASSERT_TRUE(disk);
+            if (auto v = std::dynamic_pointer_cast<fxc::vhd>(disk)) {
+                payload = (osl::endian_reverse(v->iBAT[2]) * 512ULL) + 512;
+                entry = osl::endian_reverse(v->iHeader.TableOffset) + (3 * 4);
+            } else if (auto v = std::dynamic_pointer_cast<fxc::vhdx>(disk)) {
+                payload = VHDX_BAT_ENTRY_GET_FILE_OFFSET(v->iBAT[2]);
+                entry = _3M + (3 * 8) + 7;
+            }
+        }
+        // a payload bit is caught by its checksum, the structure is intact
+        ASSERT_TRUE(flip(image, payload + 100));
+        voptions.source = nullptr;
+        report = fxc::verify_virtual_disk(image.wstring(), voptions);
+        EXPECT_TRUE(report.problems.empty());
+        EXPECT_EQ(report.bad, std::vector<uint64_t>({2}));
+        // a bat entry pointing past the end of the file is not followed
+        ASSERT_TRUE(flip(image, entry));
+        report = fxc::verify_virtual_disk(image.wstring(), voptions);
+        EXPECT_EQ(report.problems.size(), 1);
+        EXPECT_EQ(report.bad, std::vector<uint64_t>({2, 3}));
+    }
+}
+
+TEST(VirtualDisk, IncrementalFromHashes) {
+    scratch_folder folder("incremental");
+    ASSERT_TRUE(folder.ok());
+    auto volume = folder / "volume.img";
+    uint64_t length = 24 * _1M + _4K;
+    auto data = random_bytes(length, 5);
+    // a hole over grains 8 to 11 is free space, neither hashed nor copied
+    std::fill(data.begin() + 8 * _1M, data.begin() + 12 * _1M, 0);
+    ASSERT_TRUE(make_volume(volume, data, {{0, 8 * _1M}, {12 * _1M, length - 12 * _1M}}));
+    auto change = [&](uint64_t offset, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            data[offset + i] ^= 0x5A;
+        }
+        return patch_file(volume, data.data() + offset, len, offset);
+    };
+    for (auto format : {L"vhd", L"vhdx"}) {
+        auto parent = folder / (std::wstring(L"volume.") + format);
+        auto child = folder / (std::wstring(L"child.") + format);
+        fxc::copy_options options;
+        options.hashes = parent.wstring() + L".hashes";
+        fxc::createBaseVirtualDiskFromSource(std::wstring(L"d-") + format, volume.wstring(),
+            npl::make_file(parent.wstring(), true), nullptr, options);
+        ASSERT_TRUE(std::filesystem::exists(options.hashes));
+        // inside grain 1, across grains 4 and 5, into the hole and the tail
+        ASSERT_TRUE(change(_1M + 300, 100));
+        ASSERT_TRUE(change(5 * _1M - _4K, 2 * _4K));
+        ASSERT_TRUE(change(9 * _1M, _4K));
+        ASSERT_TRUE(change(length - 100, 100));
+        fxc::change_stats stats;
+        options.hashes = child.wstring() + L".hashes";
+        ASSERT_TRUE(fxc::create_child_from_hashes(format, fxc::make_block_source(volume.wstring()),
+            parent.wstring(), npl::make_file(child.wstring(), true), options, &stats));
+        EXPECT_EQ(stats.changed, 5);
+        EXPECT_LT(stats.grains, 25);
+        EXPECT_LT(std::filesystem::file_size(child), std::filesystem::file_size(parent));
+        auto disk = fxc::get_virtual_disk(child.wstring());
+        ASSERT_TRUE(disk);
+        EXPECT_EQ(disk->getChain().size(), 2);
+        std::vector<uint8_t> read(length);
+        ASSERT_EQ(disk->read_sync(read.data(), length, disk->getPartitionStartOffset(0)), (int32_t)length);
+        EXPECT_TRUE(read == data);
+        disk.reset();
+        // the child's hashes are the base of the next incremental
+        fxc::block_hashes prev, next;
+        ASSERT_TRUE(prev.load(options.hashes));
+        auto changed = fxc::find_changed_grains(fxc::make_block_source(volume.wstring()), prev, next);
+        EXPECT_TRUE(changed.empty());
+    }
+}
+
+TEST(VirtualDisk, MergeChainLevels) {
+    scratch_folder folder("merge");
+    ASSERT_TRUE(folder.ok());
+    auto volume = folder / "volume.img";
+    uint64_t length = 12 * _1M + _4K;
+    auto data = random_bytes(length, 9);
+    ASSERT_TRUE(make_volume(volume, data));
+    auto change = [&](uint64_t offset, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            data[offset + i] ^= 0x3C;
+        }
+        return patch_file(volume, data.data() + offset, len, offset);
+    };
+    for (auto format : {L"vhd", L"vhdx"}) {
+        std::vector<std::filesystem::path> levels = {folder / (std::wstring(L"volume.") + format)};
+        fxc::copy_options options;
+        options.hashes = levels[0].wstring() + L".hashes";
+        fxc::createBaseVirtualDiskFromSource(std::wstring(L"d-") + format, volume.wstring(),
+            npl::make_file(levels[0].wstring(), true), nullptr, options);
+        // overlapping sector runs, the newest level has to win
+        for (int i = 1; i <= 3; i++) {
+            ASSERT_TRUE(change(_1M + (i * 1000), 3000));
+            ASSERT_TRUE(change(i * 3 * _1M + _4K, _64K));
+            levels.push_back(folder / (L"child" + std::to_wstring(i) + L"." + format));
+            options.hashes = levels[i].wstring() + L".hashes";
+            ASSERT_TRUE(fxc::create_child_from_hashes(format, fxc::make_block_source(volume.wstring()),
+                levels[i - 1].wstring(), npl::make_file(levels[i].wstring(), true), options));
+        }
+        auto leaf = levels.back().wstring();
+        auto contents = [&](size_t depth) {
+            auto disk = fxc::get_virtual_disk(leaf);
+            EXPECT_TRUE(disk);
+            std::vector<uint8_t> out;
+            if (disk) {
+                EXPECT_EQ(disk->getChain().size(), depth);
+                out.resize(disk->getPartitionStartOffset(0) + length);
+                EXPECT_EQ(disk->read_sync(out.data(), out.size(), 0), (int32_t)out.size());
+                disk->close();
+            }
+            return out;
+        };
+        auto before = contents(4);
+        ASSERT_EQ(std::vector<uint8_t>(before.end() - length, before.end()), data);
+        // child1 into child2, the leaf keeps resolving its parent
+        fxc::merge_stats stats;
+        ASSERT_TRUE(fxc::merge_virtual_disk(leaf, 1, 2, true, {}, &stats));
+        EXPECT_GT(stats.blocks, 0);
+        EXPECT_EQ(stats.mismatched, 0);
+        EXPECT_FALSE(std::filesystem::exists(levels[2].wstring() + L".merge"));
+        EXPECT_EQ(open_handles(levels[2]), 0);
+        EXPECT_TRUE(contents(3) == before);
+        EXPECT_TRUE(fxc::verify_virtual_disk(leaf).ok());
+        // everything into a synthetic full in place of the leaf
+        ASSERT_TRUE(fxc::merge_virtual_disk(leaf, 0, 3, true, {}, &stats));
+        EXPECT_EQ(stats.mismatched, 0);
+        EXPECT_EQ(open_handles(levels.back()), 0);
+        EXPECT_TRUE(contents(1) == before);
+        EXPECT_TRUE(fxc::verify_virtual_disk(leaf).ok());
+        EXPECT_FALSE(fxc::merge_virtual_disk(leaf, 0, 2));
+    }
+}
+
+// the client side of the nbd handshake and transmission, over a unix socket
+struct nbd_test_client {
+
+    int fd = -1;
+    uint64_t size = 0;
+    uint16_t flags = 0;
+
+    template <typename T>
+    static T be(T v) {
+        return osl::endian_reverse(v);
+    }
+
+    bool recv_all(void *b, size_t l) {
+        for (size_t done = 0; done < l; ) {
+            auto n = ::recv(fd, (char *)b + done, l - done, 0);
+            if (n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    bool connect_and_go(const std::string& path) {
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (::connect(fd, (sockaddr *)&addr, sizeof(addr))) {
+            return false;
+        }
+        uint8_t hello[18];
+        uint64_t magic, opt;
+        if (!recv_all(hello, sizeof(hello))) {
+            return false;
+        }
+        memcpy(&magic, hello, 8);
+        memcpy(&opt, hello + 8, 8);
+        if (be(magic) != 0x4e42444d41474943ULL || be(opt) != 0x49484156454F5054ULL) {
+            return false;
+        }
+        // fixed newstyle, no zeroes, then NBD_OPT_GO for the default export
+        uint32_t cflags = be<uint32_t>(3);
+        ::send(fd, &cflags, 4, 0);
+        uint8_t go[16 + 8] = { 0 };
+        uint64_t ihaveopt = be(0x49484156454F5054ULL);
+        uint32_t option = be<uint32_t>(7), length = be<uint32_t>(8);
+        uint16_t requests = be<uint16_t>(1), blocksize = be<uint16_t>(3);
+        memcpy(go, &ihaveopt, 8);
+        memcpy(go + 8, &option, 4);
+        memcpy(go + 12, &length, 4);
+        memcpy(go + 20, &requests, 2);
+        memcpy(go + 22, &blocksize, 2);
+        ::send(fd, go, sizeof(go), 0);
+        while (true) {
+            uint8_t hdr[20];
+            uint32_t type, len;
+            if (!recv_all(hdr, sizeof(hdr))) {
+                return false;
+            }
+            memcpy(&type, hdr + 12, 4);
+            memcpy(&len, hdr + 16, 4);
+            std::vector<uint8_t> data(be(len));
+            if (data.size() && !recv_all(data.data(), data.size())) {
+                return false;
+            }
+            if (be(type) == 1) {
+                return size > 0;
+            }
+            if (be(type) == 3 && data.size() == 12 && !data[0] && !data[1]) {
+                memcpy(&size, data.data() + 2, 8);
+                memcpy(&flags, data.data() + 10, 2);
+                size = be(size);
+                flags = be(flags);
+            }
+        }
+    }
+
+    void request(uint16_t type, uint64_t handle, uint64_t offset, uint32_t length, const uint8_t *data = nullptr) {
+        uint8_t req[28] = { 0 };
+        uint32_t magic = be<uint32_t>(0x25609513);
+        type = be(type);
+        offset = be(offset);
+        auto len = be(length);
+        memcpy(req, &magic, 4);
+        memcpy(req + 6, &type, 2);
+        memcpy(req + 8, &handle, 8);
+        memcpy(req + 16, &offset, 8);
+        memcpy(req + 24, &len, 4);
+        ::send(fd, req, sizeof(req), MSG_NOSIGNAL);
+        if (data) {
+            ::send(fd, data, length, MSG_NOSIGNAL);
+        }
+    }
+
+    // error and handle of the next reply, its payload when it is a read
+    bool reply(uint32_t& error, uint64_t& handle) {
+        uint8_t hdr[16];
+        uint32_t magic;
+        if (!recv_all(hdr, sizeof(hdr))) {
+            return false;
+        }
+        memcpy(&magic, hdr, 4);
+        memcpy(&error, hdr + 4, 4);
+        memcpy(&handle, hdr + 8, 8);
+        error = be(error);
+        return be(magic) == 0x67446698;
+    }
+
+    ~nbd_test_client() {
+        if (fd >= 0) {
+            request(2, 0, 0, 0);
+            ::close(fd);
+        }
+    }
+};
+
+TEST(VirtualDisk, NbdServesChainsReadOnlyAndCopyOnWrite) {
+    scratch_folder folder("nbd");
+    ASSERT_TRUE(folder.ok());
+    auto volume = folder / "volume.img";
+    uint64_t length = 12 * _1M + _4K;
+    ASSERT_TRUE(make_volume(volume, random_bytes(length, 9)));
+    std::mt19937 rng(9);
+    auto image = folder / "volume.vhd";
+    fxc::createBaseVirtualDiskFromSource(L"d-vhd", volume.wstring(),
+        npl::make_file(image.wstring(), true), nullptr);
+    std::vector<uint8_t> expected;
+    {
+        auto disk = fxc::get_virtual_disk(image.wstring());
+        ASSERT_TRUE(disk);
+        expected.resize(disk->getLogicalDiskLength());
+        ASSERT_EQ(disk->read_sync(expected.data(), expected.size(), 0), (int32_t)expected.size());
+        disk->close();
+    }
+    auto sock = (folder / "nbd.sock").string();
+    {
+        fxc::nbd_options options;
+        options.workers = 3;
+        options.chunk = 64 * _1K;
+        auto server = fxc::serve_virtual_disk(image.wstring(), options);
+        ASSERT_TRUE(server);
+        ASSERT_TRUE(server->listen_unix(sock));
+        nbd_test_client client;
+        ASSERT_TRUE(client.connect_and_go(sock));
+        EXPECT_EQ(client.size, expected.size());
+        EXPECT_TRUE(client.flags & 2);
+        // pipelined reads, sequential ones and random ones, answered in any order
+        std::map<uint64_t, std::pair<uint64_t, uint32_t>> reads;
+        for (uint64_t h = 0; h < 32; h++) {
+            uint64_t off = (h < 8) ? _2M + h * 100000 : rng() % (client.size - _1M);
+            uint32_t len = (h < 8) ? 100000 : 1 + rng() % (300 * _1K);
+            if (h < 8 && h) {
+                off = reads[h - 1].first + reads[h - 1].second;
+            }
+            reads[h] = {off, len};
+            client.request(0, h, off, len);
+        }
+        for (size_t i = 0; i < reads.size(); i++) {
+            uint32_t error = ~0u;
+            uint64_t handle = ~0ULL;
+            ASSERT_TRUE(client.reply(error, handle));
+            ASSERT_EQ(error, 0);
+            ASSERT_TRUE(reads.count(handle));
+            auto [off, len] = reads[handle];
+            std::vector<uint8_t> got(len);
+            ASSERT_TRUE(client.recv_all(got.data(), len));
+            EXPECT_EQ(memcmp(got.data(), expected.data() + off, len), 0) << "handle " << handle;
+        }
+        // read only refuses writes, nothing is read past the end
+        uint8_t bytes[16] = { 1 };
+        uint32_t error = 0;
+        uint64_t handle = 0;
+        client.request(1, 100, 0, sizeof(bytes), bytes);
+        ASSERT_TRUE(client.reply(error, handle));
+        EXPECT_EQ(error, 1);
+        client.request(0, 101, client.size - 8, 16);
+        ASSERT_TRUE(client.reply(error, handle));
+        EXPECT_EQ(error, 22);
+        EXPECT_EQ(handle, 101);
+        EXPECT_GT(server->stats().hits + server->stats().prefetched, 0);
+        // stopping closes every worker's chain, a client arriving after is hung up on
+        server->stop();
+        EXPECT_EQ(open_handles(image), 0);
+        int sv[2];
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        server->serve(sv[0]);
+        char b;
+        EXPECT_EQ(::read(sv[1], &b, 1), 0);
+        close(sv[1]);
+    }
+    {
+        fxc::nbd_options options;
+        options.mode = fxc::nbd_mode::copy_on_write;
+        auto server = fxc::serve_virtual_disk(image.wstring(), options);
+        ASSERT_TRUE(server);
+        ASSERT_TRUE(server->listen_unix(sock));
+        nbd_test_client client;
+        ASSERT_TRUE(client.connect_and_go(sock));
+        EXPECT_FALSE(client.flags & 2);
+        // unaligned across a page boundary, the rest of both pages is the image's
+        std::vector<uint8_t> bytes(5000, 0xAB);
+        uint64_t off = _4M + _4K - 1000;
+        client.request(1, 1, off, bytes.size(), bytes.data());
+        uint32_t error = ~0u;
+        uint64_t handle = 0;
+        ASSERT_TRUE(client.reply(error, handle));
+        EXPECT_EQ(error, 0);
+        memcpy(expected.data() + off, bytes.data(), bytes.size());
+        client.request(0, 2, _4M, 3 * _4K);
+        ASSERT_TRUE(client.reply(error, handle));
+        std::vector<uint8_t> got(3 * _4K);
+        ASSERT_TRUE(client.recv_all(got.data(), got.size()));
+        EXPECT_EQ(memcmp(got.data(), expected.data() + _4M, got.size()), 0);
+    }
+    // the image itself is untouched
+    auto disk = fxc::get_virtual_disk(image.wstring());
+    std::vector<uint8_t> page(_4K);
+    ASSERT_EQ(disk->read_sync(page.data(), page.size(), _4M + _4K), (int32_t)page.size());
+    EXPECT_NE(page[0], 0xAB);
+    disk->close();
+}
+
+TEST(VirtualDisk, NbdStopsWhileAClientPipelines) {
+    scratch_folder folder("nbd_stop");
+    ASSERT_TRUE(folder.ok());
+    auto volume = folder / "volume.img";
+    ASSERT_TRUE(make_volume(volume, std::vector<uint8_t>(8 * _1M)));
+    auto image = folder / "volume.vhd";
+    fxc::createBaseVirtualDiskFromSource(L"d-vhd", volume.wstring(),
+        npl::make_file(image.wstring(), true), nullptr);
+    auto sock = (folder / "nbd.sock").string();
+    // stops landing between a request header and its job, a job queued after
+    // the workers left would keep stop() joining its session for good
+    for (int i = 0; i < 20; i++) {
+        fxc::nbd_options options;
+        options.workers = 2;
+        auto server = fxc::serve_virtual_disk(image.wstring(), options);
+        ASSERT_TRUE(server);
+        ASSERT_TRUE(server->listen_unix(sock));
+        std::atomic<bool> sending{true};
+        std::thread client([&]() {
+            nbd_test_client c;
+            if (c.connect_and_go(sock)) {
+                for (uint64_t h = 0; sending; h++) {
+                    c.request(0, h, (h % 64) * _64K, _4K);
+                }
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::microseconds(100 + (i * 997) % 3000));
+        server->stop();
+        sending = false;
+        client.join();
+    }
+}
+
+TEST(VirtualDisk, BitmapScanMatchesBitLoop) {
+    std::mt19937 rng(5);
+    for (int round = 0; round < 200; round++) {
+        uint64_t size = 1 + rng() % 700;
+        std::vector<uint8_t> lsb((size + 7) / 8, 0), msb((size + 7) / 8, 0);
+        // runs of random length, some crossing word boundaries
+        for (uint64_t pos = rng() % 40; pos < size; pos += 1 + rng() % 90) {
+            auto count = std::min<uint64_t>(1 + rng() % 80, size - pos);
+            fxc::set_bits<fxc::bit_order::lsb>(lsb.data(), pos, count);
+            fxc::set_bits<fxc::bit_order::msb>(msb.data(), pos, count);
+            pos += count;
+        }
+        uint64_t begin = rng() % size;
+        uint64_t end = begin + rng() % (size - begin + 1);
+        fxc::bit_runs expected;
+        for (uint64_t i = begin; i < end; i++) {
+            bool set = lsb[i / 8] & (1 << (i % 8));
+            EXPECT_EQ(set, (bool)(msb[i / 8] & (0x80 >> (i % 8))));
+            if (set && expected.size() && expected.back().first + expected.back().count == i) {
+                expected.back().count++;
+            } else if (set) {
+                expected.push_back({i, 1});
+            }
+        }
+        auto a = fxc::bitmap_scan<fxc::bit_order::lsb>(lsb.data(), size).runs(begin, end);
+        auto b = fxc::bitmap_scan<fxc::bit_order::msb>(msb.data(), size).runs(begin, end);
+        ASSERT_EQ(a.size(), expected.size());
+        ASSERT_EQ(b.size(), expected.size());
+        for (size_t i = 0; i < expected.size(); i++) {
+            EXPECT_EQ(a[i].first, expected[i].first);
+            EXPECT_EQ(a[i].count, expected[i].count);
+            EXPECT_EQ(b[i].first, expected[i].first);
+            EXPECT_EQ(b[i].count, expected[i].count);
+        }
+    }
+}
+
+#endif
+
 #endif
\ No newline at end of file